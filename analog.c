@@ -2,6 +2,11 @@
 /*********************************************
 * Analog conversion
 *
+* The ADC samples the target voltage in the background: Timer0 compare
+* match A (the 1ms tick) triggers a conversion, the ADC interrupt sums
+* VTARGET_SAMPLES results. Readers only convert the last complete sum,
+* they never wait for the ADC.
+*
 * Modified by: Clancy Palmer
 * Original Author: Guido Socher
 * License: GPL
@@ -9,85 +14,81 @@
 **********************************************/
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <stdlib.h>
 #include "analog.h"
 #include "uart.h"
+#include "hal.h"
 
 #define VTARGET_ADC_CHANNEL 0
+// averaging filter, a new value every VTARGET_SAMPLES ms
+#define VTARGET_SAMPLES 8
+
+static uint16_t adc_sum = 0;
+static unsigned char adc_n = 0;
+static volatile uint16_t vtarget_sum = 0; // last complete sum, 0 = none yet
 
-// Return analog value of a given channel w/out interrupts 
-unsigned int convertanalog(unsigned char channel, uint8_t debug) 
+ISR(ADC_vect)
 {
-  unsigned char msg_buf[16];
+  unsigned char adlow = ADCL;   // Read low first
+  unsigned char adhigh = ADCH;  // Then read high
+
+  adc_sum += (adhigh << 8) | adlow;
+  if (++adc_n == VTARGET_SAMPLES) {
+    vtarget_sum = adc_sum;
+    adc_sum = 0;
+    adc_n = 0;
+  }
+}
 
+void analog_init(void)
+{
   /* Configure ADC reference and channel
    * REFS1 = 1, REFS0 = 1 - Internal 1.1V reference w/ external capacitor on AREF pin
    * MUX3, MUX2, MUX1, MUX0 = Channel
    */
-	ADMUX = (1 << REFS1) | (1 << REFS0) | (channel & 0x0f);
+  ADMUX = (1 << REFS1) | (1 << REFS0) | (VTARGET_ADC_CHANNEL & 0x0f);
+
+  /* Auto trigger on Timer0 compare match A, the conversion starts with
+   * the 1ms tick and the timer interrupt clears the trigger flag.
+   * ADTS2 = 0, ADTS1 = 1, ADTS0 = 1 - Timer/Counter0 Compare Match A
+   */
+  ADCSRB = (1 << ADTS1) | (1 << ADTS0);
 
   /* Configure ADC enabled with clock prescaler of 128 (Clock = 18.432MHz) to stay in
-   * the recommended 50-200kHz range and no interrupts.
+   * the recommended 50-200kHz range, auto triggered, with interrupt.
    * ADEN = 1 - ADC Enabled
+   * ADATE = 1 - Auto trigger
+   * ADIE = 1 - Conversion complete interrupt
    * ADPS2 = 1, ADPS1 = 1, ADPS0 = 1 - Clock prescaler of 128
    */
-  ADCSRA = (1 << ADEN) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
-
-  // Start conversion
-	ADCSRA |= (1<<ADSC);
-	while (ADCSRA & (1 << ADSC)); // Wait for result 
-	unsigned char adlow = ADCL;   // Read low first 
-	unsigned char adhigh = ADCH;  // Then read high
-
-  if (debug) {
-    uart_sendstr_p(PSTR("ADCL: "));
-    utoa(adlow, (char *)msg_buf, 10);
-    uart_sendstr((char *)msg_buf);
-    uart_sendchar('\x1B');
-    uart_sendchar('E');
-    uart_sendstr_p(PSTR("ADCH: "));
-    utoa(adhigh, (char *)msg_buf, 10);
-    uart_sendstr((char *)msg_buf);
-    uart_sendchar('\x1B');
-    uart_sendchar('E');
-  }
+  ADCSRA = (1 << ADEN) | (1 << ADATE) | (1 << ADIE) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+}
 
-  uint16_t ret = (unsigned int)((adhigh << 8) | (adlow & 0xFF));
-  
-  if (debug) {
-    uart_sendstr_p(PSTR("ADC: "));
-    utoa(ret, (char *)msg_buf, 10);
-    uart_sendstr((char *)msg_buf);
-    uart_sendchar('\x1B');
-    uart_sendchar('E');
-  }
+// Sum of the last VTARGET_SAMPLES conversions
+static uint16_t vtarget_adc(void)
+{
+  uint16_t sum;
+  uint8_t sreg = SREG;
 
-  return ret;
+  cli();
+  sum = vtarget_sum;
+  SREG = sreg;
+  return sum;
 }
 
-
-unsigned char analog2v(unsigned int aval, uint8_t debug)
+static unsigned char analog2v(uint16_t sum)
 {
   // VTGT = 5.0V
   // VADCPIN(47k/220k divider) = 5.0 * (47 / (47 + 220)) = 0.88014V
   // AVAL(1.1V ref, 10-bit ADC) = (0.88014 / 1.1) * 1024 = 819.339 = 819
-  // 
-  // AVAL = 819
-  // VADCPIN = (819 / 1024) * 1.1 = 0.879785 - Percentage of 1.1V reference
-  // VTGT = 0.879785 * ((47 + 220) / 47) = 4.99792 - Scaled back up from 47/220 divider
-  // VTGT(*10 multiplier) = 4.99792 * 10 = 49.9792 - Multiplied by 10 for spec
-  // RET(VTGT rounded) = ((49.9792 * 10) + 5) / 10 = 50.479 = 50 (matches 5.0V)
   //
-  // VTGT = (AVAL / 1024 * 1.1) * (267 / 47) * 10
-  // VTGT = AVAL * 1.1 * 10 * 267 / 47 / 1024 - Multiplication first to keep precision
-  // VTGTx10 = (AVAL * 1.1 * 10 * 267 * 10) / (47 * 1024) - Scaled by 10 to keep precision
-  // VTGTx10 = AVAL * 293700 / 48128 = AVAL * 73425 / 12032 = AVAL * 6.102476728
-  // VTGTx10(approx) = AVAL * 6.1025 = AVAL * 6 * 41/400 - Close approximation to prevent overflow
-  // VTGT(rounded) = ((AVAL * 6 * 41 / 400) + 5) / 10 - Rounded and scaled back down
-
-  //uint32_t r = (((uint32_t)aval * 6 * 41 / 400) + 5) / 10;
-
-  uint32_t r = (uint32_t)(((float)aval / 1024) * 267 / 47 * 10);
+  // The conversion always was VTGTx10 = AVAL / 1024 * 267 / 47 * 10 (truncated),
+  // without the 1.1V reference factor. Same result in integers, for the
+  // sum of VTARGET_SAMPLES values:
+  // VTGTx10 = SUM * 2670 / (1024 * 47 * VTARGET_SAMPLES)
+  // SUM < 8192, SUM * 2670 fits in 32 bits.
+  uint32_t r = (uint32_t)sum * 2670 / (1024UL * 47 * VTARGET_SAMPLES);
   return (unsigned char)(r & 0xff);
 }
 
@@ -96,7 +97,7 @@ unsigned char vtarget_valid(void)
 {
   // 74ACH125 chip will handle 2-7V but
   // < 3.0V will not register logic 1 on MISO pin
-  // > 5.5V will overvoltage MISO 
+  // > 5.5V will overvoltage MISO
   unsigned char vtrg = vtarget_voltage();
   return (vtrg >= 30 && vtrg <= 55); // 3.0V - 5.5V
 }
@@ -104,8 +105,16 @@ unsigned char vtarget_valid(void)
 // Returns target voltage * 10 (ie. 3.3V = 33)
 unsigned char vtarget_voltage_debug()
 {
-  return analog2v(convertanalog(VTARGET_ADC_CHANNEL, 1), 1);
+  unsigned char msg_buf[16];
+  uint16_t sum = vtarget_adc();
+
+  uart_sendstr_p(PSTR("ADC: "));
+  utoa(sum / VTARGET_SAMPLES, (char *)msg_buf, 10);
+  uart_sendstr((char *)msg_buf);
+  uart_sendchar('\x1B');
+  uart_sendchar('E');
+  return analog2v(sum);
 }
 unsigned char vtarget_voltage(void) {
-  return analog2v(convertanalog(VTARGET_ADC_CHANNEL, 0), 0);
-}
\ No newline at end of file
+  return analog2v(vtarget_adc());
+}
@@ -11,6 +11,7 @@
 #ifndef ANALOG_H
 #define ANALOG_H
 
+extern void analog_init(void);                // Start background sampling, needs the Timer0 tick
 extern unsigned char vtarget_valid(void);     // Return 1 if target voltage is valid, 0 otherwise
 extern unsigned char vtarget_voltage(void);   // Return target voltage * 10
 extern unsigned char vtarget_voltage_debug(void); // Return target voltage, optionally printing debug traces
@@ -0,0 +1,146 @@
+/* vim: set sw=2 ts=2 si et: */
+/*********************************************
+* avrusb500v3 extensions to the STK500v2 protocol
+*
+* Vendor specific parameters and commands. The IDs are chosen
+* from ranges not used by AVR068 or the STK600/AVRISP mkII so that
+* standard host software never sends them by accident.
+*
+* Author: Clancy Palmer
+* License: GPL
+* Copyright: GPL
+**********************************************/
+
+#ifndef COMMAND_EXT_H
+#define COMMAND_EXT_H
+
+// *****************[ Vendor parameter constants ]***************************
+// Read with CMD_GET_PARAMETER, counters are reset with CMD_SET_PARAMETER (any value)
+
+#define PARAM_EXT_UART_OVERRUNS             0xE0        // bytes lost to UART overrun
+#define PARAM_EXT_UART_FRAMING_ERRORS       0xE1        // bytes dropped with framing error
+#define PARAM_EXT_SKIPPED_BYTES_LOW         0xE4        // 0xFF flash bytes not loaded
+#define PARAM_EXT_SKIPPED_BYTES_HIGH        0xE5
+#define PARAM_EXT_SKIPPED_PAGES_LOW         0xE6        // all 0xFF flash pages not written
+#define PARAM_EXT_SKIPPED_PAGES_HIGH        0xE7
+#define PARAM_EXT_POLL_TIMEOUTS             0xE8        // writes that did not finish in 100ms
+#define PARAM_EXT_POLL_LAST                 0xE9        // polls of the last write (read only)
+#define PARAM_EXT_POLL_MAX                  0xEA        // most polls of one write
+#define PARAM_EXT_WRITE_TIME_FLASH          0xEB        // measured write times in 1/8 ms (read only)
+#define PARAM_EXT_WRITE_TIME_EEPROM         0xEC
+#define PARAM_EXT_WRITE_TIME_ERASE          0xED
+#define PARAM_EXT_WAIT_REQUESTED_LOW        0xEE        // ms of delays asked for
+#define PARAM_EXT_WAIT_REQUESTED_HIGH       0xEF
+#define PARAM_EXT_WAIT_BLOCKED_LOW          0xF0        // ms actually spent waiting for them
+#define PARAM_EXT_WAIT_BLOCKED_HIGH         0xF1
+#define PARAM_EXT_RECONNECTS                0xF4        // CMD_ENTER_PROGMODE_ISP without power cycle sequence
+#define PARAM_EXT_UNCHANGED_PAGES_LOW       0xF8        // pages not written, the target already held them
+#define PARAM_EXT_UNCHANGED_PAGES_HIGH      0xF9
+#define PARAM_EXT_RX_TIMEOUTS               0xFA        // frames dropped after 20ms without a byte
+#define PARAM_EXT_RX_RESYNCS                0xFB        // frames found again inside discarded bytes
+
+// Performance counters, 32 bit each, read one at a time: CMD_SET_PARAMETER
+// PARAM_EXT_PERF_SELECT n selects counter n, then every CMD_GET_PARAMETER
+// PARAM_EXT_PERF_DATA returns the next byte of it, LSB first. The value is
+// latched with its first byte, after the fourth the next counter follows.
+// CMD_GET_PARAMETER PARAM_EXT_PERF_SELECT returns the number of counters,
+// CMD_SET_PARAMETER PARAM_EXT_PERF_DATA (any value) clears all of them,
+// including the ones shared with 0xE0, 0xE1, 0xE8 and 0xEE-0xF1. Accessing
+// the counters is not counted. Times are in 1/8 ms.
+#define PARAM_EXT_PERF_SELECT               0xFC
+#define PARAM_EXT_PERF_DATA                 0xFD
+#define PERF_FRAMES                         0           // valid frames received
+#define PERF_CKSUM_ERRORS                   1           // frames with checksum error
+#define PERF_UART_OVERRUNS                  2           // as PARAM_EXT_UART_OVERRUNS
+#define PERF_SPI_BYTES                      3           // bytes sent to the target, each also received
+#define PERF_SPI_TIME                       4           // time SCK was clocking them
+#define PERF_POLL_TIME                      5           // time waiting for writes to finish
+#define PERF_DELAY_TIME                     6           // time in delay_ms() and fixed write delays,
+                                                        // up to their deadlines
+#define PERF_UART_WAIT                      7           // time waiting for the previous answer to go out
+#define PERF_POLL_TIMEOUTS                  8           // as PARAM_EXT_POLL_TIMEOUTS
+#define PERF_SYNC_RETRIES                   9           // CMD_ENTER_PROGMODE_ISP synchronisation retries
+#define PERF_EEPROM_UNCHANGED               10          // EEPROM bytes not written, the target held them
+#define PERF_STACK_FREE                     11          // bytes of RAM the stack never reached since reset,
+                                                        // 0xFFFF in the host build
+#define PERF_DELAY_OVERSHOOT                12          // time the delays returned after their deadlines
+#define PERF_HISTOGRAM                      13          // command times, PERF_BUCKETS counters per class,
+                                                        // classes and not commands to fit the RAM:
+#define PERF_CLASS_PROGRAM                  0           //   CMD_PROGRAM_FLASH/EEPROM_ISP, CMD_EXT_PROGRAM_FLASH_PACKED
+#define PERF_CLASS_READ                     1           //   CMD_READ_FLASH/EEPROM_ISP, CMD_EXT_CHECKSUM_ISP
+#define PERF_CLASS_SESSION                  2           //   enter/leave progmode, chip erase
+#define PERF_CLASS_OTHER                    3
+#define PERF_CLASSES                        4
+#define PERF_BUCKETS                        5           //   < 1ms, < 4ms, < 16ms, < 64ms, longer
+#define PERF_COUNT                          (PERF_HISTOGRAM + PERF_CLASSES * PERF_BUCKETS)
+
+// Settings, written with CMD_SET_PARAMETER, default 0
+
+#define PARAM_EXT_EARLY_ANSWER              0xE2        // 1: answer page writes before polling,
+                                                        // a poll timeout is the status of the next answer
+#define PARAM_EXT_SKIP_ERASED               0xE3        // 1: page mode flash programming does not load
+                                                        // 0xFF bytes and skips 0xFF pages after chip erase
+#define PARAM_EXT_RECONNECT_GRACE           0xF3        // n: CMD_LEAVE_PROGMODE_ISP keeps the target in reset
+                                                        // n * 100ms for a fast CMD_ENTER_PROGMODE_ISP
+#define PARAM_EXT_BAUD                      0xF5        // UART baud rate, switched after the answer, back
+                                                        // to 115200 without a valid message within 1s,
+                                                        // values UART_BAUD_* of uart.h
+#define PARAM_EXT_SKIP_UNCHANGED            0xF7        // 1: page mode programming without chip erase in
+                                                        // this session reads the page first, an unchanged
+                                                        // page is neither loaded nor written
+#define PARAM_EXT_EEPROM                    0xFE        // CMD_PROGRAM_EEPROM_ISP, bits:
+#define EEPROM_RDY_BSY                      0x01        //   poll RDY/BSY after every write, no timed delays
+#define EEPROM_SKIP_UNCHANGED               0x02        //   read every byte first, do not write unchanged ones
+#define EEPROM_PAGE_SHIFT                   4           //   bits 4-6 n > 0: word mode messages with the EEPROM
+                                                        //   write instruction (0xC0) are written in pages of
+                                                        //   2^n bytes with 0xC1/0xC2
+#define PARAM_EXT_SCK_FAST                  0xFF        // 1: PARAM_SCK_DURATION 0 runs SCK at 2.304MHz
+                                                        // instead of 1.8432MHz, targets clocked >= 14MHz
+
+// Settings stored in the programmer EEPROM
+
+#define PARAM_EXT_DELAY_PROFILE             0xF2        // SPI byte delays of CMD_READ_*_ISP and CMD_SPI_MULTI:
+#define DELAY_PROFILE_CONSERVATIVE          0           //   5ms after every byte (default)
+#define DELAY_PROFILE_DATASHEET             1           //   only the write time after write instructions
+#define DELAY_PROFILE_ZERO                  2           //   none
+#define PARAM_EXT_BAUD_DEFAULT              0xF6        // baud rate after power up (as 0xF5), also falls
+                                                        // back to 115200 if the first message is not valid
+
+// *****************[ Vendor command constants ]*****************************
+
+// CMD_PROGRAM_FLASH_ISP with packed data. Same header (NumBytes is the
+// unpacked length), the data is a sequence of blocks:
+//   0x00-0x7F n, n + 1 literal bytes
+//   0x80-0xFF n, d: (n & 0x7F) + 2 bytes copied from d + 1 bytes back (d < 16),
+//                   bytes before the start of the message are 0xFF
+// The blocks must unpack to exactly NumBytes, otherwise nothing is
+// written and the answer is STATUS_CMD_FAILED.
+#define CMD_EXT_PROGRAM_FLASH_PACKED        0x70
+#define PACKED_HISTORY                      16
+
+// CRC-32 (as zlib) and blank check of a target memory range, read by the
+// programmer. Message: command, memory type (0 flash, 1 EEPROM), read
+// instruction (cmd1 of CMD_READ_FLASH_ISP/CMD_READ_EEPROM_ISP), start
+// address as CMD_LOAD_ADDRESS (4 bytes), length in bytes (4 bytes, MSB
+// first). Answer: command, status, CRC-32 (4 bytes, MSB first),
+// 1 if all bytes are 0xFF else 0, status. The address is left after
+// the range like after CMD_READ_FLASH_ISP.
+#define CMD_EXT_CHECKSUM_ISP                0x71
+#define CHECKSUM_FLASH                      0
+#define CHECKSUM_EEPROM                     1
+
+// Trace of the last TRACE_SIZE messages, oldest first. Message: command
+// [, 1 to clear the trace after reading it]. Answer: command, status, one
+// entry per message: command, seqnum, answer status, low 16 bits of the
+// address at the start (2 bytes), processing time in 1/8 ms (2 bytes),
+// both MSB first. Checksum errors show up as ANSWER_CKSUM_ERROR entries,
+// CMD_EXT_TRACE and the performance counter accesses are not recorded.
+// make TRACE=n keeps n messages, TRACE=0 leaves the trace out for RAM
+// (CMD_EXT_TRACE is then unknown).
+#define CMD_EXT_TRACE                       0x72
+#ifndef TRACE_SIZE
+#define TRACE_SIZE                          4
+#endif
+#define TRACE_ENTRY                         7
+
+#endif /* COMMAND_EXT_H */
@@ -0,0 +1,32 @@
+/* vim: set sw=2 ts=2 si et: */
+/*********************************************
+* CRC-32 (IEEE 802.3, as zlib and Python's zlib.crc32)
+*
+* Reflected polynomial 0xEDB88320, four bits at a time: the 16 entry
+* table costs 64 bytes of flash instead of 1KB for a byte table.
+*
+* Author: Clancy Palmer
+* License: GPL
+* Copyright: GPL
+**********************************************/
+
+#include <avr/pgmspace.h>
+#include "crc32.h"
+
+static const uint32_t crc32_nibble[16] PROGMEM = {
+  0x00000000UL, 0x1DB71064UL, 0x3B6E20C8UL, 0x26D930ACUL,
+  0x76DC4190UL, 0x6B6B51F4UL, 0x4DB26158UL, 0x5005713CUL,
+  0xEDB88320UL, 0xF00F9344UL, 0xD6D6A3E8UL, 0xCB61B38CUL,
+  0x9B64C2B0UL, 0x86D3D2D4UL, 0xA00AE278UL, 0xBDBDF21CUL
+};
+
+uint32_t crc32_update(uint32_t crc, const unsigned char *buf, unsigned int n)
+{
+  crc = ~crc;
+  while (n--) {
+    crc ^= *buf++;
+    crc = (crc >> 4) ^ pgm_read_dword(&crc32_nibble[crc & 0x0F]);
+    crc = (crc >> 4) ^ pgm_read_dword(&crc32_nibble[crc & 0x0F]);
+  }
+  return ~crc;
+}
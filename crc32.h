@@ -0,0 +1,18 @@
+/* vim: set sw=2 ts=2 si et: */
+/*********************************************
+* CRC-32 (IEEE 802.3, as zlib and Python's zlib.crc32)
+*
+* Author: Clancy Palmer
+* License: GPL
+* Copyright: GPL
+**********************************************/
+
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+
+// crc of the data so far (0 at the start), returns the crc including buf
+extern uint32_t crc32_update(uint32_t crc, const unsigned char *buf, unsigned int n);
+
+#endif /* CRC32_H */
@@ -0,0 +1,27 @@
+/* vim: set sw=2 ts=2 si et: */
+/*********************************************
+* Hardware abstraction for the host build
+*
+* The firmware accesses the ATMega88 registers directly. The host
+* build (HOST_BUILD, see sim/) replaces the avr-libc headers with
+* sim/include where the registers are plain variables, so busy waits
+* on a hardware flag must call HAL_IDLE() to let the simulated UART,
+* ADC and clock make progress. On the AVR these are no-ops.
+*
+* Author: Clancy Palmer
+* License: GPL
+* Copyright: GPL
+**********************************************/
+
+#ifndef HAL_H
+#define HAL_H
+
+#ifdef HOST_BUILD
+extern void hal_idle(void);
+extern unsigned char hal_spi_xfer(unsigned char data, unsigned int half);
+#define HAL_IDLE()        hal_idle()
+#else
+#define HAL_IDLE()
+#endif
+
+#endif /* HAL_H */
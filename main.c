@@ -22,9 +22,12 @@
 #include "timeout.h"
 #include "uart.h"
 #include "analog.h"
+#include "crc32.h"
 #include "led.h"
 #include "spi.h"
 #include "command.h"
+#include "command_ext.h"
+#include "hal.h"
 
 #define CONFIG_PARAM_BUILD_NUMBER_LOW   0
 #define CONFIG_PARAM_BUILD_NUMBER_HIGH  1
@@ -39,6 +42,8 @@
 #define EEPROM_MAJOR            ((uint8_t*)2)
 #define EEPROM_MINOR            ((uint8_t*)1)
 #define EEPROM_MAGIC            ((uint8_t*)0)
+#define EEPROM_DELAY_PROFILE    ((uint8_t*)3)   // 0xFF (erased) is the default profile
+#define EEPROM_BAUD             ((uint8_t*)4)   // 0xFF (erased) is 115200
 uint8_t CONFIG_PARAM_SW_MAJOR;
 uint8_t CONFIG_PARAM_SW_MINOR;
 const char terminal_init[] PROGMEM = {"\x1B[0m\x1B[2J\x1B[0;0f"};
@@ -59,13 +64,241 @@ static unsigned char extended_address = 0;
 static unsigned long address = 0;
 static uint16_t saddress = 0;
 
-static unsigned char msg_buf[295];
+// Two message buffers (AVR068: max. 275 bytes + checksum in an answer, 280
+// in a message). The RX interrupt parses the next message into msg_rx_buf
+// while programcmd() works on and answers from msg_buf, main() swaps them.
+#define MSG_BUF_SIZE 286
+#define MSG_MAX_LEN 280
+static unsigned char msg_bufs[2][MSG_BUF_SIZE];
+static unsigned char *msg_buf = msg_bufs[0];
+static unsigned char * volatile msg_rx_buf = msg_bufs[1];
+static volatile unsigned char msg_rx_state = MSG_IDLE;
+static volatile unsigned char msg_rx_ready = 0; // 1 = message, 2 = checksum error
+#define MSG_RX_HOLD 3   // msg_rx_ready while main() parses discarded bytes again
+static volatile unsigned char msg_rx_seqnum = 0;
+static unsigned char msg_rx_cksum;
+static unsigned int msg_rx_len;
+static unsigned int msg_rx_pos;
+static unsigned char msg_rx_hdr[4];     // seqnum, size, token/checksum as received
+// a frame without a byte for this long is dropped (host gave up, byte lost)
+#define MSG_RX_TIMEOUT_MS 20
+static volatile uint16_t msg_rx_time;   // millis() of the last byte
+static unsigned char msg_rx_timeouts = 0;
+static unsigned char msg_rx_resyncs = 0;
+static unsigned int msg_len;    // body length of the message in msg_buf
+static volatile unsigned char terminal_active = 0;
+
 static unsigned char param_controller_init = 0;
+static unsigned char param_early_answer = 0;
+static unsigned char deferred_status = STATUS_CMD_OK; // poll result of an early answer
+// Write completion: polls are bounded by time, not by a loop count, and
+// start after most of the measured write time of the target has passed.
+// Times in 1/TIMER_TICKS_MS ms.
+#define WR_FLASH 0
+#define WR_EEPROM 1
+#define WR_ERASE 2
+#define POLL_TIMEOUT (100 * TIMER_TICKS_MS)
+static uint16_t write_time[3];  // running estimate per kind of write
+static unsigned char poll_timeouts = 0;
+static unsigned char poll_last = 0;  // polls of the last write
+static unsigned char poll_max = 0;   // most polls of a write
+static unsigned long poll_time = 0;  // in wait_write()
+// page write answered early (PARAM_EXT_EARLY_ANSWER) or timed write delay
+// still running, write_finish() waits for it before the target is used
+// again. A delay can not fail, it always runs while the answer is sent and
+// the next message comes in.
+#define WR_DELAY 0xFF   // pend_rdop of a timed delay, pend_start is its deadline
+static unsigned char pend_kind = 0;     // WR_* + 1, 0 = none
+static uint16_t pend_start;
+static unsigned char pend_rdop;         // as wait_write()
+static unsigned int pend_addr;
+static unsigned char pend_poll;
+
+// skip loading 0xFF bytes and writing erased pages
+static unsigned char param_skip_erased = 0;
+static unsigned char target_erased = 0;  // chip erase since enter progmode
+static unsigned char page_loaded = 0;    // page buffer holds loaded bytes
+static uint16_t skipped_bytes = 0;
+static uint16_t skipped_pages = 0;
+// compare and skip pages the target already holds
+static unsigned char param_skip_unchanged = 0;
+static uint16_t unchanged_pages = 0;
+// EEPROM programming (PARAM_EXT_EEPROM)
+static unsigned char param_eeprom = 0;
+static uint16_t eeprom_unchanged = 0;   // bytes not written
 static unsigned char detected_vtg = 0; // Measured voltage from target
+static unsigned char delay_profile = DELAY_PROFILE_CONSERVATIVE;
+
+// fast reconnect: CMD_LEAVE_PROGMODE_ISP keeps the target in reset and in
+// programming mode for the grace window, an ENTER with the same parameters
+// then needs one programming enable instruction instead of the power up
+#define PARK_NONE 0
+#define PARK_READY 1   // in programming mode, LEAVE may park
+#define PARK_ACTIVE 2  // left, target still in reset
+static unsigned char param_reconnect_grace = 0; // 100ms units, 0 = off
+static unsigned char park_state = PARK_NONE;
+static uint16_t park_until;             // millis()
+static unsigned char park_enter[11];    // parameters of the last ENTER
+static unsigned char reconnects = 0;
+static unsigned char sync_retries = 0;
+
+// performance counters (PARAM_EXT_PERF_*), the others are kept by the
+// modules they measure
+static uint16_t perf_frames = 0;
+static unsigned char perf_cksum_errors = 0;
+static uint16_t perf_hist[PERF_CLASSES * PERF_BUCKETS];  // command times
+static unsigned char perf_pos = 0;      // counter * 4 + byte of the next PARAM_EXT_PERF_DATA
+static unsigned long perf_latch;
+
+#if TRACE_SIZE
+// post-mortem trace of the last messages (CMD_EXT_TRACE, terminal mode),
+// the entries are kept as they are sent
+static unsigned char trace[TRACE_SIZE * TRACE_ENTRY];
+static unsigned char trace_head = 0;    // offset of the next entry
+#endif
+
+// baud rate switch: a new rate is on trial until the first valid message,
+// back to 115200 if none comes within BAUD_TRIAL_MS
+#define BAUD_TRIAL_MS 1000
+#define BAUD_TRIAL_NONE 0
+#define BAUD_TRIAL_WAIT 1       // power up rate, the trial starts with the first byte
+#define BAUD_TRIAL_RUN 2
+static unsigned char baud_next = 0;     // rate + 1 to switch to after the answer
+static unsigned char baud_trial = BAUD_TRIAL_NONE;
+static uint16_t baud_trial_end;         // millis()
+
+static unsigned char msg_rx_byte(unsigned char ch);
+
+/* the frame being received is none: parse the bytes after its
+ * MESSAGE_START again from the next MESSAGE_START among them */
+static void msg_rx_resync(const unsigned char *d, unsigned char n)
+{
+  unsigned char buf[4];
+  unsigned char i;
+
+  memcpy(buf, d, n);
+  msg_rx_state = MSG_IDLE;
+  for (i = 0; i < n && buf[i] != MESSAGE_START; i++);
+  if (i < n && msg_rx_resyncs != 0xFF) {
+    msg_rx_resyncs++;
+  }
+  for (; i < n; i++) {
+    msg_rx_byte(buf[i]);
+  }
+}
+
+/* parse messages according to appl. note AVR068 table 3-1 straight
+ * into msg_rx_buf. Returns 0 for bytes outside messages. */
+static unsigned char msg_rx_byte(unsigned char ch)
+{
+  switch (msg_rx_state) {
+    case MSG_IDLE:
+      if (ch != MESSAGE_START) {
+        return 0;
+      }
+      msg_rx_state = MSG_WAIT_SEQNUM;
+      msg_rx_cksum = 0;
+      break;
+    case MSG_WAIT_SEQNUM:
+      msg_rx_seqnum = ch;
+      msg_rx_hdr[0] = ch;
+      msg_rx_state = MSG_WAIT_SIZE1;
+      break;
+    case MSG_WAIT_SIZE1:
+      msg_rx_len = ch << 8;
+      msg_rx_hdr[1] = ch;
+      msg_rx_state = MSG_WAIT_SIZE2;
+      break;
+    case MSG_WAIT_SIZE2:
+      msg_rx_len |= ch;
+      msg_rx_hdr[2] = ch;
+      msg_rx_state = MSG_WAIT_TOKEN;
+      break;
+    case MSG_WAIT_TOKEN:
+      if (ch != TOKEN || msg_rx_len > MSG_MAX_LEN) {
+        // not a frame, the next one may start in its header
+        msg_rx_hdr[3] = ch;
+        msg_rx_resync(msg_rx_hdr, 4);
+        return 1;
+      }
+      msg_rx_pos = 0;
+      msg_rx_state = msg_rx_len ? MSG_WAIT_MSG : MSG_WAIT_CKSUM;
+      break;
+    case MSG_WAIT_MSG:
+      msg_rx_buf[msg_rx_pos++] = ch;
+      if (msg_rx_pos == msg_rx_len) {
+        msg_rx_state = MSG_WAIT_CKSUM;
+      }
+      break;
+    case MSG_WAIT_CKSUM:
+      // kept for msg_rx_rescan()
+      msg_rx_hdr[3] = ch;
+      msg_rx_ready = (ch == msg_rx_cksum && msg_rx_len > 0) ? 1 : 2;
+      msg_rx_state = MSG_IDLE;
+      return 1;
+  }
+  msg_rx_cksum ^= ch;
+  return 1;
+}
+
+/* called by the RX interrupt. The parser stops while a complete
+ * message waits for main(), the bytes go to the UART ring buffer until
+ * msg_rx_held(). Bytes outside messages go there too (terminal mode). */
+unsigned char uart_rx_msg(unsigned char ch)
+{
+  if (terminal_active || msg_rx_ready) {
+    return 0;
+  }
+  msg_rx_time = millis();
+  return msg_rx_byte(ch);
+}
+
+/* msg_rx_ready is MSG_RX_HOLD: parse what the RX interrupt put into the
+ * ring buffer while a message was waiting for main() (a pipelining host),
+ * then let the interrupt parse again. Bytes outside messages are dropped. */
+static void msg_rx_held(void)
+{
+  while (msg_rx_ready == MSG_RX_HOLD && uart_rx_available()) {
+    msg_rx_byte(uart_getchar(0));
+  }
+  cli();
+  while (msg_rx_ready == MSG_RX_HOLD && uart_rx_available()) {
+    msg_rx_byte(uart_getchar(0));
+  }
+  if (msg_rx_ready == MSG_RX_HOLD) {
+    msg_rx_ready = 0;
+  }
+  msg_rx_time = millis();
+  sei();
+}
+
+/* checksum error in the message now in msg_buf. If a byte of it was
+ * lost the parser took the start of the next frame as data: parse the
+ * discarded bytes again from the first MESSAGE_START, then what came in
+ * meanwhile. The RX interrupt leaves the parser alone until then. */
+static void msg_rx_rescan(void)
+{
+  unsigned int i;
+
+  msg_rx_ready = MSG_RX_HOLD;
+  for (i = 0; i < msg_len && msg_buf[i] != MESSAGE_START; i++);
+  if ((i < msg_len || msg_rx_hdr[3] == MESSAGE_START) && msg_rx_resyncs != 0xFF) {
+    msg_rx_resyncs++;
+  }
+  for (; i < msg_len && msg_rx_ready == MSG_RX_HOLD; i++) {
+    msg_rx_byte(msg_buf[i]);
+  }
+  if (msg_rx_ready == MSG_RX_HOLD) {
+    msg_rx_byte(msg_rx_hdr[3]);
+  }
+  msg_rx_held();
+}
 
 /* transmit an answer back to the programmer software, message is
  * in msg_buf, seqnum is the seqnum of the last message from the programmer software,
- * len=1..275 according to avr068 */
+ * len=1..275 according to avr068.
+ * The checksum is appended to msg_buf and the message is sent in the background
+ * by the UART interrupt. msg_buf must not be changed until uart_tx_busy() is 0. */
 void transmit_answer(unsigned char seqnum, unsigned int len)
 {
   unsigned char cksum;
@@ -91,27 +324,582 @@ void transmit_answer(unsigned char seqnum, unsigned int len)
   cksum ^= TOKEN;
   wdt_reset();
   for (i = 0; i < len; i++) {
-    uart_sendchar(msg_buf[i]);
     cksum ^= msg_buf[i];
   }
-  uart_sendchar(cksum);
+  msg_buf[len] = cksum;
+  uart_sendbuf(msg_buf, len + 1);
+}
+
+/* start values for the write time estimates, ATmega datasheet times */
+static void write_time_init(void)
+{
+  write_time[WR_FLASH] = 45 * TIMER_TICKS_MS / 10;
+  write_time[WR_EEPROM] = 36 * TIMER_TICKS_MS / 10;
+  write_time[WR_ERASE] = 9 * TIMER_TICKS_MS;
+}
+
+/* read one byte with the read instruction op (EEPROM, flash low or high byte) */
+static unsigned char isp_read(unsigned char op, unsigned int addr)
+{
+  spi_mastertransmit_nr(op);
+  spi_mastertransmit_16_nr(addr);
+  return spi_mastertransmit(0x00);
+}
+
+/* wait for the end of a write started at <start>. rdop == 0 polls
+ * RDY/BSY, otherwise the data at addr is read with rdop until it
+ * differs from pollval. Returns 0 on timeout. */
+static unsigned char wait_write(unsigned char kind, uint16_t start, unsigned char rdop, unsigned int addr,
+                                unsigned char pollval)
+{
+  uint16_t t;
+  uint16_t entry = timer_now();
+  unsigned char busy;
+  unsigned char n = 0;
+
+  // no need to ask while the write certainly runs
+  while ((uint16_t)(timer_now() - start) < write_time[kind] - write_time[kind] / 4) {
+    HAL_IDLE();
+    wdt_reset();
+  }
+  do {
+    wdt_reset();
+    if (rdop) {
+      busy = (isp_read(rdop, addr) == pollval);
+    } else {
+      busy = spi_mastertransmit_32(0xF0000000) & 1;
+    }
+    if (n != 0xFF) {
+      n++;
+    }
+    t = timer_now() - start;
+  } while (busy && t < POLL_TIMEOUT);
+  poll_time += (uint16_t)(timer_now() - entry);
+  poll_last = n;
+  if (n > poll_max) {
+    poll_max = n;
+  }
+  if (busy) {
+    if (poll_timeouts != 0xFF) {
+      poll_timeouts++;
+    }
+    return 0;
+  }
+  // follow the target, a quarter of the new measurement counts
+  write_time[kind] = write_time[kind] - write_time[kind] / 4 + t / 4;
+  return 1;
+}
+
+/* wait for the write described by pend_*, returns the status of the
+ * command that started it */
+static unsigned char write_finish(void)
+{
+  unsigned char kind = pend_kind - 1;
+
+  pend_kind = 0;
+  if (pend_rdop == WR_DELAY) {
+    timer_wait(pend_start);
+  } else if (!wait_write(kind, pend_start, pend_rdop, pend_addr, pend_poll)) {
+    return pend_rdop ? STATUS_CMD_TOUT : STATUS_RDY_BSY_TOUT;
+  }
+  return STATUS_CMD_OK;
+}
+
+/* finish a write that was answered early, a timeout is the status of
+ * the next answer */
+static void write_finish_early(void)
+{
+  unsigned char st;
+
+  if (pend_kind) {
+    st = write_finish();
+    if (st != STATUS_CMD_OK) {
+      deferred_status = st;
+    }
+  }
+}
+
+/* the target is busy until deadline, the next write_finish_early() waits */
+static void write_delay(uint16_t deadline)
+{
+  pend_kind = 1;
+  pend_rdop = WR_DELAY;
+  pend_start = deadline;
+}
+
+/* ms the target needs after the serial programming instruction at
+ * instr, 0 for anything but a write. Longest times of the ATmega
+ * datasheets (tWD_ERASE and tWD_EEPROM 9ms on the ATmega8). */
+static unsigned char isp_write_delay(const unsigned char *instr)
+{
+  if (instr[0] == 0xAC) {
+    if (instr[1] == 0x80) {
+      return 10; // chip erase
+    }
+    return (instr[1] == 0x53) ? 0 : 5; // fuse and lock bits, not programming enable
+  }
+  if (instr[0] == 0xC0 || instr[0] == 0xC2) {
+    return 10; // EEPROM
+  }
+  if (instr[0] == 0x4C) {
+    return 5; // flash page
+  }
+  return 0;
+}
+
+/* end of the grace window, leave programming mode for real */
+static void park_release(void)
+{
+  park_state = PARK_NONE;
+  spi_disable();
+  detected_vtg = 0;
+}
+
+/* CMD_LOAD_ADDRESS, a points to the 4 address bytes */
+static void load_address(const unsigned char *a)
+{
+  address =  ((unsigned long)a[0]) << 24;
+  address |= ((unsigned long)a[1]) << 16;
+  address |= ((unsigned long)a[2]) << 8;
+  address |= ((unsigned long)a[3]);
+  // atmega2561/atmega2560
+  //If bit 31 is set, this indicates that the following read/write operation
+  //will be performed on a memory that is larger than 64KBytes. This is an
+  //indication to STK500 that a load extended address must be executed. See
+  //datasheet for devices with memories larger than 64KBytes.
+  //
+  if (a[0] >= 0x80) {
+    larger_than_64k = 1;
+  } else {
+    larger_than_64k = 0;
+  }
+  extended_address = a[1];
+  new_address = 1;
+}
+
+/* read nbytes from address on with the read instruction op, word: flash
+ * (low and high byte per address), advances address and extended_address */
+static void read_target(unsigned char *buf, unsigned int nbytes, unsigned char op, unsigned char word)
+{
+  unsigned int i;
+  unsigned long rest;
+
+  // read contiguous runs straight into the answer, the extended
+  // address is only loaded at 64k word boundaries
+  i = 0;
+  while (i < nbytes) {
+    // In commands PROGRAM_FLASH and READ_FLASH "Load Extended Address"
+    // command is executed before every operation if we are programming
+    // processor with Flash memory bigger than 64k words and 64k words boundary
+    // is just crossed or new address was just loaded.
+    if (larger_than_64k && ((address & 0xFFFF) == 0 || new_address)) {
+      // load extended addr byte 0x4d
+      SCK_LOW;
+      spi_mastertransmit(0x4d);
+      spi_mastertransmit(0x00);
+      spi_mastertransmit(extended_address);
+      spi_mastertransmit(0x00);
+      new_address = 0;
+    }
+    // bytes up to the next 64k word boundary
+    rest = 0x10000UL - (address & 0xFFFF);
+    if (word) {
+      rest *= 2;
+    }
+    if (rest > nbytes - i) {
+      rest = nbytes - i;
+    }
+    spi_read_block(buf + i, op, address & 0xFFFF, rest, word);
+    i += rest;
+    if (word) {
+      //increment word address only when we have an uneven byte
+      rest /= 2;
+      if ((address & 0xFFFF) < 0xFFFF && (address & 0xFFFF) + rest >= 0xFFFF) {
+        extended_address++;
+      }
+    }
+    address += rest;
+  }
+}
+
+/* CMD_EXT_PROGRAM_FLASH_PACKED: unpack the data of msg_buf one byte
+ * at a time, straight into the page loads */
+static unsigned char unpack_hist[PACKED_HISTORY];
+static unsigned char unpack_h;      // next history slot
+static unsigned int unpack_in;      // next packed byte in msg_buf
+static unsigned char unpack_left;   // bytes left in the current block
+static unsigned char unpack_dist;   // 0 = literal block, else copy distance
+static unsigned char unpack_err;
+
+static void unpack_init(void)
+{
+  memset(unpack_hist, 0xFF, sizeof(unpack_hist));
+  unpack_h = 0;
+  unpack_in = 10;
+  unpack_left = 0;
+  unpack_err = 0;
+}
+
+static unsigned char unpack_byte(void)
+{
+  unsigned char c;
+
+  if (unpack_left == 0) {
+    // next block
+    if (unpack_in >= msg_len) {
+      unpack_err = 1;
+      return 0xFF;
+    }
+    c = msg_buf[unpack_in++];
+    if (c & 0x80) {
+      if (unpack_in >= msg_len || msg_buf[unpack_in] >= PACKED_HISTORY) {
+        unpack_err = 1;
+        return 0xFF;
+      }
+      unpack_left = (c & 0x7F) + 2;
+      unpack_dist = msg_buf[unpack_in++] + 1;
+    } else {
+      unpack_left = c + 1;
+      unpack_dist = 0;
+    }
+  }
+  if (unpack_dist) {
+    c = unpack_hist[(unpack_h - unpack_dist) & (PACKED_HISTORY - 1)];
+  } else if (unpack_in < msg_len) {
+    c = msg_buf[unpack_in++];
+  } else {
+    unpack_err = 1;
+    return 0xFF;
+  }
+  unpack_left--;
+  unpack_hist[unpack_h] = c;
+  unpack_h = (unpack_h + 1) & (PACKED_HISTORY - 1);
+  return c;
+}
+
+/* all of the message used and nothing left over */
+static unsigned char unpack_complete(void)
+{
+  return !unpack_err && unpack_left == 0 && unpack_in == msg_len;
+}
+
+/* 1 if the packed data of msg_buf unpacks to exactly nbytes. Runs before
+ * anything is sent to the target and leaves the unpacker at the start. */
+static unsigned char unpack_check(unsigned int nbytes)
+{
+  unsigned char ok;
+
+  unpack_init();
+  while (nbytes && !unpack_err) {
+    unpack_byte();
+    nbytes--;
+  }
+  ok = unpack_complete();
+  unpack_init();
+  return ok;
+}
+
+/* CMD_PROGRAM_*_ISP with PARAM_EXT_SKIP_UNCHANGED: returns 1 if the target
+ * already holds the data of msg_buf, the address is then after the page as
+ * if it was loaded. Stops reading at the first difference, the address and
+ * the unpacker are then back at the start of the message. */
+static unsigned char page_unchanged(unsigned int nbytes, unsigned char word, unsigned char packed)
+{
+  unsigned char buf[8];
+  unsigned long start_address = address;
+  unsigned char start_extended = extended_address;
+  unsigned int i, j, n;
+
+  for (i = 0; i < nbytes; i += n) {
+    n = nbytes - i;
+    if (n > sizeof(buf)) {
+      n = sizeof(buf);
+    }
+    read_target(buf, n, msg_buf[7], word);
+    for (j = 0; j < n; j++) {
+      if (buf[j] != (packed ? unpack_byte() : msg_buf[i + j + 10])) {
+        break;
+      }
+    }
+    if (j < n) {
+      break;
+    }
+  }
+  if (i < nbytes) {
+    address = start_address;
+    extended_address = start_extended;
+    // the reads may have moved the extended address of the target
+    new_address = 1;
+    if (packed) {
+      unpack_init();
+    }
+    return 0;
+  }
+  return 1;
+}
+
+/* wait for the end of an EEPROM write issued just now, RDY/BSY polling
+ * with EEPROM_RDY_BSY, else the delay of the message. Returns 0 on timeout. */
+static unsigned char eeprom_wait(void)
+{
+  uint16_t start = timer_now();
+
+  if (param_eeprom & EEPROM_RDY_BSY) {
+    return wait_write(WR_EEPROM, start, 0, 0, 0);
+  }
+  write_delay(timer_after(start, msg_buf[4]));
+  return 1;
+}
+
+/* 1 if EEPROM_SKIP_UNCHANGED finds data at the EEPROM address a already */
+static unsigned char eeprom_unchanged_byte(unsigned int a, unsigned char data)
+{
+  if (!(param_eeprom & EEPROM_SKIP_UNCHANGED) || !msg_buf[7] || isp_read(msg_buf[7], a) != data) {
+    return 0;
+  }
+  if (eeprom_unchanged != 0xFFFF) {
+    eeprom_unchanged++;
+  }
+  return 1;
+}
+
+/* CMD_PROGRAM_EEPROM_ISP in word mode with PARAM_EXT_EEPROM set. The
+ * bytes are written one at a time or, with a page size, loaded into the
+ * EEPROM page buffer and written at the end of every page. Only loaded
+ * bytes are written, so skipped bytes keep their value. Returns the status. */
+static unsigned char eeprom_program(unsigned int nbytes)
+{
+  unsigned int i;
+  unsigned int a = 0;
+  unsigned char data;
+  unsigned char loaded = 0;
+  unsigned char mask = 0;   // page size - 1, 0: byte writes
+  unsigned char status = STATUS_CMD_OK;
+
+  if (msg_buf[5] == 0xC0 && (param_eeprom >> EEPROM_PAGE_SHIFT)) {
+    mask = (1 << ((param_eeprom >> EEPROM_PAGE_SHIFT) & 0x07)) - 1;
+  }
+  for (i = 0; i < nbytes; i++) {
+    wdt_reset();
+    data = msg_buf[i + 10];
+    a = address & 0xFFFF;
+    write_finish_early();
+    if (!eeprom_unchanged_byte(a, data)) {
+      // Load EEPROM Memory Page or Write EEPROM Memory
+      spi_mastertransmit_nr(mask ? 0xC1 : msg_buf[5]);
+      spi_mastertransmit_16_nr(a);
+      spi_mastertransmit_nr(data);
+      if (mask) {
+        loaded = 1;
+      } else if (!eeprom_wait()) {
+        status = STATUS_CMD_TOUT;
+      }
+    }
+    address++;
+    if (loaded && ((address & mask) == 0 || i == nbytes - 1)) {
+      // Write EEPROM Memory Page
+      write_finish_early();
+      spi_mastertransmit_nr(0xC2);
+      spi_mastertransmit_16_nr(a);
+      spi_mastertransmit_nr(0);
+      if (!eeprom_wait()) {
+        status = STATUS_CMD_TOUT;
+      }
+      loaded = 0;
+    }
+  }
+  return status;
+}
+
+#ifndef HOST_BUILD
+// Stack headroom: the RAM from the end of the static data (_end) to the
+// top of the stack is painted before main() runs, the bytes still painted
+// were never used by the stack.
+#define STACK_PAINT 0xC5
+extern unsigned char _end;
+extern unsigned char __stack;
+void stack_paint(void) __attribute__((naked, used, section(".init1")));
+void stack_paint(void)
+{
+  // no C here: r1 is not zero and there is no stack pointer yet
+  __asm__ volatile (
+    "    ldi r30, lo8(_end)"       "\n\t"
+    "    ldi r31, hi8(_end)"       "\n\t"
+    "    ldi r24, %[paint]"        "\n\t"
+    "    ldi r25, hi8(__stack)"    "\n\t"
+    "    rjmp 2f"                  "\n\t"
+    "1:  st Z+, r24"               "\n\t"
+    "2:  cpi r30, lo8(__stack)"    "\n\t"
+    "    cpc r31, r25"             "\n\t"
+    "    brlo 1b"                  "\n\t"
+    "    breq 1b"
+    :: [paint] "M" (STACK_PAINT));
+}
+
+static uint16_t stack_free(void)
+{
+  const unsigned char *p = &_end;
+  uint16_t n = 0;
+
+  while (p <= &__stack && *p == STACK_PAINT) {
+    p++;
+    n++;
+  }
+  return n;
+}
+#else
+#define stack_free() 0xFFFF
+#endif
+
+/* histogram class of the message in msg_buf, PERF_NONE for accesses to
+ * the performance counters and the trace, they are not counted */
+#define PERF_NONE PERF_CLASSES
+static unsigned char perf_class(void)
+{
+  switch (msg_buf[0]) {
+    case CMD_PROGRAM_FLASH_ISP:
+    case CMD_PROGRAM_EEPROM_ISP:
+    case CMD_EXT_PROGRAM_FLASH_PACKED:
+      return PERF_CLASS_PROGRAM;
+    case CMD_READ_FLASH_ISP:
+    case CMD_READ_EEPROM_ISP:
+    case CMD_EXT_CHECKSUM_ISP:
+      return PERF_CLASS_READ;
+    case CMD_ENTER_PROGMODE_ISP:
+    case CMD_LEAVE_PROGMODE_ISP:
+    case CMD_CHIP_ERASE_ISP:
+      return PERF_CLASS_SESSION;
+    case CMD_SET_PARAMETER:
+    case CMD_GET_PARAMETER:
+      if (msg_buf[1] == PARAM_EXT_PERF_SELECT || msg_buf[1] == PARAM_EXT_PERF_DATA) {
+        return PERF_NONE;
+      }
+      break;
+    case CMD_EXT_TRACE:
+      return PERF_NONE;
+  }
+  return PERF_CLASS_OTHER;
+}
+
+/* count a frame of class cls that took t (1/TIMER_TICKS_MS ms) */
+static void perf_record(unsigned char cls, uint16_t t)
+{
+  unsigned char b = 0;
+  uint16_t *h;
+
+  if (perf_frames != 0xFFFF) {
+    perf_frames++;
+  }
+  // buckets grow by 4, the first ends at 1ms
+  while (b < PERF_BUCKETS - 1 && t >= (TIMER_TICKS_MS << (2 * b))) {
+    b++;
+  }
+  h = &perf_hist[cls * PERF_BUCKETS + b];
+  if (*h != 0xFFFF) {
+    (*h)++;
+  }
+}
+
+static unsigned long perf_counter(unsigned char n)
+{
+  switch (n) {
+    case PERF_FRAMES:
+      return perf_frames;
+    case PERF_CKSUM_ERRORS:
+      return perf_cksum_errors;
+    case PERF_UART_OVERRUNS:
+      return uart_rx_overruns();
+    case PERF_SPI_BYTES:
+      return spi_stats_bytes();
+    case PERF_SPI_TIME:
+      return spi_stats_time();
+    case PERF_POLL_TIME:
+      return poll_time;
+    case PERF_DELAY_TIME:
+      return timer_wait_blocked_ticks();
+    case PERF_UART_WAIT:
+      return uart_tx_wait_time();
+    case PERF_POLL_TIMEOUTS:
+      return poll_timeouts;
+    case PERF_SYNC_RETRIES:
+      return sync_retries;
+    case PERF_EEPROM_UNCHANGED:
+      return eeprom_unchanged;
+    case PERF_STACK_FREE:
+      return stack_free();
+    case PERF_DELAY_OVERSHOOT:
+      return timer_wait_overshoot_ticks();
+  }
+  return perf_hist[n - PERF_HISTOGRAM];
+}
+
+#if TRACE_SIZE
+/* trace entry of the message in msg_buf, trace_end() completes it with
+ * the answer */
+static void trace_begin(unsigned char seqnum)
+{
+  unsigned char *e = &trace[trace_head];
+
+  e[0] = msg_buf[0];
+  e[1] = seqnum;
+  e[3] = (address >> 8) & 0xFF;
+  e[4] = address & 0xFF;
+}
+
+static void trace_end(uint16_t t)
+{
+  unsigned char *e = &trace[trace_head];
+
+  e[2] = msg_buf[1];
+  e[5] = t >> 8;
+  e[6] = t & 0xFF;
+  trace_head += TRACE_ENTRY;
+  if (trace_head == sizeof(trace)) {
+    trace_head = 0;
+  }
+}
+#else
+#define trace_begin(seqnum)
+#define trace_end(t)
+#endif
+
+static void perf_clear(void)
+{
+  perf_frames = 0;
+  perf_cksum_errors = 0;
+  uart_rx_clear_errors();
+  spi_stats_clear();
+  poll_time = 0;
+  timer_wait_clear();
+  uart_tx_wait_clear();
+  poll_timeouts = 0;
+  poll_max = 0;
+  sync_retries = 0;
+  eeprom_unchanged = 0;
+  memset(perf_hist, 0, sizeof(perf_hist));
 }
 
 void programcmd(unsigned char seqnum)
 {
-  unsigned char tmp, tmp2, addressing_is_word, ci, cj, cstatus;
+  unsigned char tmp, tmp2, addressing_is_word, ci, cj, ce, cstatus;
   unsigned int answerlen;
   unsigned int poll_address = 0;
   unsigned int i, nbytes;
+  unsigned long rest;
+  uint16_t start;
+  unsigned char wdelay = 0;
+  unsigned char packed, data;
+  uint32_t crc;
   // distingush addressing CMD_READ_EEPROM_ISP (8bit) and CMD_READ_FLASH_ISP (16bit)
   addressing_is_word = 1; // 16 bit is default
+  write_finish_early();
 
   switch (msg_buf[0]) {
     case CMD_SIGN_ON:
       //msg_buf[0] = CMD_SIGN_ON;
       msg_buf[1] = STATUS_CMD_OK;
       msg_buf[2] = 8; // Response length
-      strcpy((char *) & (msg_buf[3]), "STK500_2"); // note: this copies also the null termination
+      strcpy_P((char *) & (msg_buf[3]), PSTR("STK500_2")); // note: this copies also the null termination
       answerlen = 11;
       break;
 
@@ -126,6 +914,64 @@ void programcmd(unsigned char seqnum)
         spi_set_sck_duration(msg_buf[2]);
       } else if (msg_buf[1] == PARAM_CONTROLLER_INIT) {
         param_controller_init = msg_buf[2];
+      } else if (msg_buf[1] == PARAM_EXT_UART_OVERRUNS || msg_buf[1] == PARAM_EXT_UART_FRAMING_ERRORS) {
+        uart_rx_clear_errors();
+      } else if (msg_buf[1] == PARAM_EXT_EARLY_ANSWER) {
+        param_early_answer = msg_buf[2];
+      } else if (msg_buf[1] == PARAM_EXT_SKIP_ERASED) {
+        param_skip_erased = msg_buf[2];
+      } else if (msg_buf[1] >= PARAM_EXT_SKIPPED_BYTES_LOW && msg_buf[1] <= PARAM_EXT_SKIPPED_PAGES_HIGH) {
+        skipped_bytes = 0;
+        skipped_pages = 0;
+      } else if (msg_buf[1] == PARAM_EXT_RX_TIMEOUTS || msg_buf[1] == PARAM_EXT_RX_RESYNCS) {
+        msg_rx_timeouts = 0;
+        msg_rx_resyncs = 0;
+      } else if (msg_buf[1] == PARAM_EXT_SKIP_UNCHANGED) {
+        param_skip_unchanged = msg_buf[2];
+      } else if (msg_buf[1] == PARAM_EXT_EEPROM) {
+        param_eeprom = msg_buf[2];
+      } else if (msg_buf[1] == PARAM_EXT_SCK_FAST) {
+        spi_set_sck_fast(msg_buf[2]);
+      } else if (msg_buf[1] == PARAM_EXT_UNCHANGED_PAGES_LOW || msg_buf[1] == PARAM_EXT_UNCHANGED_PAGES_HIGH) {
+        unchanged_pages = 0;
+      } else if (msg_buf[1] >= PARAM_EXT_POLL_TIMEOUTS && msg_buf[1] <= PARAM_EXT_POLL_MAX) {
+        poll_timeouts = 0;
+        poll_max = 0;
+      } else if (msg_buf[1] >= PARAM_EXT_WAIT_REQUESTED_LOW && msg_buf[1] <= PARAM_EXT_WAIT_BLOCKED_HIGH) {
+        timer_wait_clear();
+      } else if (msg_buf[1] == PARAM_EXT_RECONNECT_GRACE) {
+        param_reconnect_grace = msg_buf[2];
+      } else if (msg_buf[1] == PARAM_EXT_RECONNECTS) {
+        reconnects = 0;
+      } else if (msg_buf[1] == PARAM_EXT_BAUD || msg_buf[1] == PARAM_EXT_BAUD_DEFAULT) {
+        if (msg_buf[2] > UART_BAUD_576000) {
+          msg_buf[1] = STATUS_CMD_FAILED;
+          answerlen = 2;
+          break;
+        }
+        if (msg_buf[1] == PARAM_EXT_BAUD) {
+          // main() switches when the answer is out
+          baud_next = msg_buf[2] + 1;
+        } else {
+          eeprom_update_byte(EEPROM_BAUD, msg_buf[2]);
+        }
+      } else if (msg_buf[1] == PARAM_EXT_PERF_SELECT) {
+        if (msg_buf[2] >= PERF_COUNT) {
+          msg_buf[1] = STATUS_CMD_FAILED;
+          answerlen = 2;
+          break;
+        }
+        perf_pos = msg_buf[2] * 4;
+      } else if (msg_buf[1] == PARAM_EXT_PERF_DATA) {
+        perf_clear();
+      } else if (msg_buf[1] == PARAM_EXT_DELAY_PROFILE) {
+        if (msg_buf[2] > DELAY_PROFILE_ZERO) {
+          msg_buf[1] = STATUS_CMD_FAILED;
+          answerlen = 2;
+          break;
+        }
+        delay_profile = msg_buf[2];
+        eeprom_update_byte(EEPROM_DELAY_PROFILE, delay_profile);
       }
       answerlen = 2;
       //msg_buf[0] = CMD_SET_PARAMETER;
@@ -185,6 +1031,109 @@ void programcmd(unsigned char seqnum)
         case PARAM_DATA: // stk500 only
           tmp = 0;
           break;
+        case PARAM_EXT_UART_OVERRUNS:
+          tmp = uart_rx_overruns();
+          break;
+        case PARAM_EXT_UART_FRAMING_ERRORS:
+          tmp = uart_rx_framing_errors();
+          break;
+        case PARAM_EXT_EARLY_ANSWER:
+          tmp = param_early_answer;
+          break;
+        case PARAM_EXT_SKIP_ERASED:
+          tmp = param_skip_erased;
+          break;
+        case PARAM_EXT_SKIPPED_BYTES_LOW:
+          tmp = skipped_bytes & 0xFF;
+          break;
+        case PARAM_EXT_SKIPPED_BYTES_HIGH:
+          tmp = skipped_bytes >> 8;
+          break;
+        case PARAM_EXT_SKIPPED_PAGES_LOW:
+          tmp = skipped_pages & 0xFF;
+          break;
+        case PARAM_EXT_SKIPPED_PAGES_HIGH:
+          tmp = skipped_pages >> 8;
+          break;
+        case PARAM_EXT_RX_TIMEOUTS:
+          tmp = msg_rx_timeouts;
+          break;
+        case PARAM_EXT_RX_RESYNCS:
+          tmp = msg_rx_resyncs;
+          break;
+        case PARAM_EXT_SKIP_UNCHANGED:
+          tmp = param_skip_unchanged;
+          break;
+        case PARAM_EXT_EEPROM:
+          tmp = param_eeprom;
+          break;
+        case PARAM_EXT_SCK_FAST:
+          tmp = spi_get_sck_fast();
+          break;
+        case PARAM_EXT_UNCHANGED_PAGES_LOW:
+          tmp = unchanged_pages & 0xFF;
+          break;
+        case PARAM_EXT_UNCHANGED_PAGES_HIGH:
+          tmp = unchanged_pages >> 8;
+          break;
+        case PARAM_EXT_POLL_TIMEOUTS:
+          tmp = poll_timeouts;
+          break;
+        case PARAM_EXT_POLL_LAST:
+          tmp = poll_last;
+          break;
+        case PARAM_EXT_POLL_MAX:
+          tmp = poll_max;
+          break;
+        case PARAM_EXT_WRITE_TIME_FLASH:
+        case PARAM_EXT_WRITE_TIME_EEPROM:
+        case PARAM_EXT_WRITE_TIME_ERASE:
+          i = write_time[msg_buf[1] - PARAM_EXT_WRITE_TIME_FLASH];
+          tmp = i > 0xFF ? 0xFF : i;
+          break;
+        case PARAM_EXT_WAIT_REQUESTED_LOW:
+          tmp = timer_wait_requested_ms() & 0xFF;
+          break;
+        case PARAM_EXT_WAIT_REQUESTED_HIGH:
+          tmp = timer_wait_requested_ms() >> 8;
+          break;
+        case PARAM_EXT_WAIT_BLOCKED_LOW:
+          tmp = timer_wait_blocked_ms() & 0xFF;
+          break;
+        case PARAM_EXT_WAIT_BLOCKED_HIGH:
+          tmp = timer_wait_blocked_ms() >> 8;
+          break;
+        case PARAM_EXT_DELAY_PROFILE:
+          tmp = delay_profile;
+          break;
+        case PARAM_EXT_RECONNECT_GRACE:
+          tmp = param_reconnect_grace;
+          break;
+        case PARAM_EXT_RECONNECTS:
+          tmp = reconnects;
+          break;
+        case PARAM_EXT_BAUD:
+          tmp = uart_get_baud();
+          break;
+        case PARAM_EXT_BAUD_DEFAULT:
+          tmp = eeprom_read_byte(EEPROM_BAUD);
+          if (tmp > UART_BAUD_576000) {
+            tmp = UART_BAUD_115200;
+          }
+          break;
+        case PARAM_EXT_PERF_SELECT:
+          tmp = PERF_COUNT;
+          break;
+        case PARAM_EXT_PERF_DATA:
+          if ((perf_pos & 3) == 0) {
+            perf_latch = perf_counter(perf_pos / 4);
+          }
+          tmp = perf_latch & 0xFF;
+          perf_latch >>= 8;
+          if (++perf_pos == PERF_COUNT * 4) {
+            perf_pos = 0;
+          }
+          break;
         default:
           tmp2 = 1; // command not understood
           break;
@@ -203,23 +1152,7 @@ void programcmd(unsigned char seqnum)
       break;
 
     case CMD_LOAD_ADDRESS:
-      address =  ((unsigned long)msg_buf[1]) << 24;
-      address |= ((unsigned long)msg_buf[2]) << 16;
-      address |= ((unsigned long)msg_buf[3]) << 8;
-      address |= ((unsigned long)msg_buf[4]);
-      // atmega2561/atmega2560
-      //If bit 31 is set, this indicates that the following read/write operation
-      //will be performed on a memory that is larger than 64KBytes. This is an
-      //indication to STK500 that a load extended address must be executed. See
-      //datasheet for devices with memories larger than 64KBytes.
-      //
-      if (msg_buf[1] >= 0x80) {
-        larger_than_64k = 1;
-      } else {
-        larger_than_64k = 0;
-      }
-      extended_address = msg_buf[2];
-      new_address = 1;
+      load_address(&msg_buf[1]);
       answerlen = 2;
       //msg_buf[0] = CMD_LOAD_ADDRESS;
       msg_buf[1] = STATUS_CMD_OK;
@@ -233,6 +1166,9 @@ void programcmd(unsigned char seqnum)
       break;
 
     case CMD_ENTER_PROGMODE_ISP: // 0x10
+      write_time_init();
+      target_erased = 0;
+      page_loaded = 0;
       // The syntax of this command is as follows:
       // 0: Command ID 1 byte, CMD_ENTER_ PROGMODE_ISP
       // 1: timeout 1 byte, Command time-out (in ms)
@@ -247,13 +1183,30 @@ void programcmd(unsigned char seqnum)
       // cmd3 1 byte
       // cmd4 1 byte
       prg_state_set(1);
+      answerlen = 2;
+      if (park_state == PARK_ACTIVE && memcmp(park_enter, &msg_buf[1], sizeof(park_enter)) == 0) {
+        // still in programming mode if the echo of the programming enable is right
+        spi_mastertransmit_nr(msg_buf[8]);
+        spi_mastertransmit_nr(msg_buf[9]);
+        tmp = spi_mastertransmit(msg_buf[10]);
+        tmp2 = spi_mastertransmit(msg_buf[11]);
+        if (msg_buf[7] == 0 || (msg_buf[7] == 3 ? tmp : tmp2) == msg_buf[6]) {
+          park_state = PARK_READY;
+          if (reconnects != 0xFF) {
+            reconnects++;
+          }
+          msg_buf[1] = STATUS_CMD_OK;
+          break;
+        }
+      }
+      park_state = PARK_NONE;
+      memcpy(park_enter, &msg_buf[1], sizeof(park_enter));
       spi_disable();
       delay_ms(15);
       detected_vtg = vtarget_voltage();
       spi_init();
       delay_ms(msg_buf[2]); // stabDelay
 
-      answerlen = 2;
       //msg_buf[0] = CMD_ENTER_PROGMODE_ISP;
       // set default to failed:
       msg_buf[1] = STATUS_CMD_FAILED;
@@ -271,6 +1224,9 @@ void programcmd(unsigned char seqnum)
         wdt_reset();
         delay_ms(msg_buf[3]); //cmdexeDelay
         i++;
+        if (i > 1 && sync_retries != 0xFF) {
+          sync_retries++;
+        }
         spi_mastertransmit_nr(msg_buf[8]);//cmd1
         delay_ms(msg_buf[5]); //byteDelay
         spi_mastertransmit_nr(msg_buf[9]); //cmd2
@@ -291,6 +1247,7 @@ void programcmd(unsigned char seqnum)
           msg_buf[1] = STATUS_CMD_OK;
         }
         if (msg_buf[1] == STATUS_CMD_OK ) {
+          park_state = PARK_READY;
           i = msg_buf[4]; // end loop
         } else {
           // new try, see e.g chapeter "Serial download" in
@@ -316,8 +1273,13 @@ void programcmd(unsigned char seqnum)
 
     case CMD_LEAVE_PROGMODE_ISP:
       prg_state_set(0);
-      spi_disable();
-      detected_vtg = 0;
+      if (param_reconnect_grace && park_state == PARK_READY) {
+        // main() releases the target when the grace window ends
+        park_state = PARK_ACTIVE;
+        park_until = millis() + param_reconnect_grace * 100U;
+      } else {
+        park_release();
+      }
       answerlen = 2;
       //msg_buf[0] = CMD_LEAVE_PROGMODE_ISP;
       msg_buf[1] = STATUS_CMD_OK;
@@ -331,22 +1293,24 @@ void programcmd(unsigned char seqnum)
       spi_mastertransmit_nr(msg_buf[6]);
       if (msg_buf[2] == 0) {
         // pollMethod use delay
-        delay_ms(msg_buf[1]); // eraseDelay
-      } else {
+        delay_ms(msg_buf[1]); // eraseDelay, read before the status goes there
+        ci = STATUS_CMD_OK;
+      } else if (wait_write(WR_ERASE, timer_now(), 0, 0, 0)) {
         // pollMethod RDY/BSY cmd
-        ci = 150; // timeout
-        while ((spi_mastertransmit_32(0xF0000000) & 1) && ci) {
-          ci--;
-        }
+        ci = STATUS_CMD_OK;
+      } else {
+        ci = STATUS_RDY_BSY_TOUT;
       }
-      answerlen = 2;
       //msg_buf[0] = CMD_CHIP_ERASE_ISP;
-      msg_buf[1] = STATUS_CMD_OK;
+      msg_buf[1] = ci;
+      target_erased = 1;
+      answerlen = 2;
       break;
 
     case CMD_PROGRAM_EEPROM_ISP:
       addressing_is_word = 0; // address each byte
     case CMD_PROGRAM_FLASH_ISP:
+    case CMD_EXT_PROGRAM_FLASH_PACKED:
       // msg_buf[0] CMD_PROGRAM_FLASH_ISP = 0x13
       // msg_buf[1] NumBytes H
       // msg_buf[2] NumBytes L
@@ -357,9 +1321,10 @@ void programcmd(unsigned char seqnum)
       // msg_buf[7] cmd3 (Read Program Memory)
       // msg_buf[8] poll1 (value to poll)
       // msg_buf[9] poll2
-      // msg_buf[n+10] Data
+      // msg_buf[n+10] Data, packed with CMD_EXT_PROGRAM_FLASH_PACKED
+      packed = (msg_buf[0] == CMD_EXT_PROGRAM_FLASH_PACKED);
       poll_address = 0;
-      ci = 150;
+      answerlen = 2;
       // set a minimum timed delay
       if (msg_buf[4] < 4) {
         msg_buf[4] = 4;
@@ -370,8 +1335,8 @@ void programcmd(unsigned char seqnum)
       }
       saddress = (address & 0xffff); // previous address, start address
       nbytes = (unsigned int)( (msg_buf[1] << 8) | msg_buf[2]);
-      if (nbytes > 280) {
-        // corrupted message
+      if (nbytes > 280 || (packed && !unpack_check(nbytes))) {
+        // corrupted message, nothing is sent to the target
         answerlen = 2;
         msg_buf[1] = STATUS_CMD_FAILED;
         break;
@@ -382,10 +1347,17 @@ void programcmd(unsigned char seqnum)
       cstatus = STATUS_CMD_OK;
       // msg_buf[3] test Word/Page Mode bit:
       SCK_LOW;
-      if ((msg_buf[3] & 1) == 0) {
+      // ce: EEPROM_* settings that apply to this message
+      ce = addressing_is_word ? 0 : param_eeprom;
+      if ((msg_buf[3] & 1) == 0 && ce) {
+        cstatus = eeprom_program(nbytes);
+      } else if ((msg_buf[3] & 1) == 0) {
         // word mode
         for (i = 0; i < nbytes; i++)
         {
+          data = packed ? unpack_byte() : msg_buf[i + 10];
+          // the delay of the previous byte
+          write_finish_early();
           // The Low/High byte selection bit is
           // bit number 3. Set high byte for uneven bytes
           if (addressing_is_word && i & 1) {
@@ -396,10 +1368,11 @@ void programcmd(unsigned char seqnum)
             spi_mastertransmit_nr(msg_buf[5]);
           }
           spi_mastertransmit_16_nr(address & 0xffff);
-          spi_mastertransmit_nr(msg_buf[i + 10]);
+          spi_mastertransmit_nr(data);
+          start = timer_now();
           // if the data byte is not same as poll value
           // in that case we can do polling:
-          if (msg_buf[8] != msg_buf[i + 10]) {
+          if (msg_buf[8] != data) {
             poll_address = address & 0xFFFF;
             // restore the possibly modifed mode:
             msg_buf[3] = tmp2;
@@ -409,37 +1382,31 @@ void programcmd(unsigned char seqnum)
           }
           //
           wdt_reset();
-          if (!addressing_is_word) {
-            // eeprom writing, eeprom needs more time
-            delay_ms(2);
+          // eeprom writing, eeprom needs more time: the polling or the
+          // timed delay starts 2ms after the write instruction
+          cj = addressing_is_word ? 0 : 2;
+          if (cj && (msg_buf[3] & 0x0C)) {
+            timer_wait(timer_after(start, cj));
           }
           //check the different polling mode methods
+          tmp = addressing_is_word ? WR_FLASH : WR_EEPROM;
           if (msg_buf[3] & 0x04) {
             //data value polling
-            tmp = msg_buf[8];
-            ci = 150; // timeout
-            while (tmp == msg_buf[8] && ci ) {
-              // The Low/High byte selection bit is
-              // bit number 3. Set high byte for uneven bytes
-              // Read data:
-              if (addressing_is_word && i & 1) {
-                spi_mastertransmit_nr(msg_buf[7] | (1 << 3));
-              } else {
-                spi_mastertransmit_nr(msg_buf[7]);
-              }
-              spi_mastertransmit_16_nr(poll_address);
-              tmp = spi_mastertransmit(0x00);
-              ci--;
+            // The Low/High byte selection bit is
+            // bit number 3. Set high byte for uneven bytes
+            if (!wait_write(tmp, start, (addressing_is_word && i & 1) ? msg_buf[7] | (1 << 3) : msg_buf[7],
+                            poll_address, msg_buf[8])) {
+              cstatus = STATUS_CMD_TOUT;
             }
           } else if (msg_buf[3] & 0x08) {
             //RDY/BSY polling
-            ci = 150; // timeout
-            while ((spi_mastertransmit_32(0xF0000000) & 1) && ci) {
-              ci--;
+            if (!wait_write(tmp, start, 0, 0, 0)) {
+              cstatus = STATUS_CMD_TOUT;
             }
           } else {
-            //timed delay (waiting)
-            delay_ms(msg_buf[4]);
+            //timed delay (waiting), from the end of the write instruction,
+            //it runs while the next byte is prepared or the answer is sent
+            write_delay(timer_after(start, cj + msg_buf[4]));
           }
           if (addressing_is_word) {
             //increment word address only when we have an uneven byte
@@ -448,40 +1415,62 @@ void programcmd(unsigned char seqnum)
             //increment address
             address++;
           }
-          if (ci == 0) {
-            cstatus = STATUS_CMD_TOUT;
-          }
+        }
+      } else if (param_skip_unchanged && (msg_buf[3] & 0x80) && !target_erased && !page_loaded &&
+                 page_unchanged(nbytes, addressing_is_word, packed)) {
+        // the whole page is in this message and the target holds it already:
+        // no load, no write, no poll. After a chip erase the compare would
+        // only find 0xFF pages, PARAM_EXT_SKIP_ERASED handles those.
+        if (unchanged_pages != 0xFFFF) {
+          unchanged_pages++;
         }
       } else {
         //page mode, all modern chips, atmega etc...
+        // cj: skip 0xFF flash bytes, the page buffer is 0xFF after a page write.
+        // Not for eeprom, there only the loaded bytes are written.
+        cj = param_skip_erased && addressing_is_word;
         i = 0;
         while (i < nbytes) {
           wdt_reset();
-          // In commands PROGRAM_FLASH and READ_FLASH "Load Extended Address"
-          // command is executed before every operation if we are programming
-          // processor with Flash memory bigger than 64k words and 64k words boundary
-          // is just crossed or new address was just loaded.
-          if (larger_than_64k && ((address & 0xFFFF) == 0 || new_address)) {
-            // load extended addr byte 0x4d
-            spi_mastertransmit(0x4d);
-            spi_mastertransmit(0x00);
-            spi_mastertransmit(extended_address);
-            spi_mastertransmit(0x00);
-            new_address = 0;
-          }
-          // The Low/High byte selection bit is
-          // bit number 3. Set high byte for uneven bytes
-          if (addressing_is_word && i & 1) {
-            spi_mastertransmit_nr(msg_buf[5] | (1 << 3));
+          data = packed ? unpack_byte() : msg_buf[i + 10];
+          if (cj && data == 0xFF) {
+            if (skipped_bytes != 0xFFFF) {
+              skipped_bytes++;
+            }
+            if ((address & 0xFFFF) == 0) {
+              // load the extended address with the next byte
+              new_address = 1;
+            }
+          } else if (ce && eeprom_unchanged_byte(address & 0xFFFF, data)) {
+            // an EEPROM page write leaves the bytes that were not loaded alone
           } else {
-            spi_mastertransmit_nr(msg_buf[5]);
+            // In commands PROGRAM_FLASH and READ_FLASH "Load Extended Address"
+            // command is executed before every operation if we are programming
+            // processor with Flash memory bigger than 64k words and 64k words boundary
+            // is just crossed or new address was just loaded.
+            if (larger_than_64k && ((address & 0xFFFF) == 0 || new_address)) {
+              // load extended addr byte 0x4d
+              spi_mastertransmit(0x4d);
+              spi_mastertransmit(0x00);
+              spi_mastertransmit(extended_address);
+              spi_mastertransmit(0x00);
+              new_address = 0;
+            }
+            // The Low/High byte selection bit is
+            // bit number 3. Set high byte for uneven bytes
+            if (addressing_is_word && i & 1) {
+              spi_mastertransmit_nr(msg_buf[5] | (1 << 3));
+            } else {
+              spi_mastertransmit_nr(msg_buf[5]);
+            }
+            spi_mastertransmit_16_nr(address & 0xffff);
+            spi_mastertransmit_nr(data);
+            page_loaded = 1;
           }
-          spi_mastertransmit_16_nr(address & 0xffff);
-          spi_mastertransmit_nr(msg_buf[i + 10]);
 
           // the data byte is not same as poll value
           // in that case we can do polling:
-          if (msg_buf[8] != msg_buf[i + 10]) {
+          if (msg_buf[8] != data) {
             poll_address = address & 0xFFFF;
           } else {
             //switch the mode to timed delay (waiting)
@@ -506,48 +1495,55 @@ void programcmd(unsigned char seqnum)
         //
         // stk sets the Write page bit (7) if the page is complete
         // and we should write it.
-        if (msg_buf[3] & 0x80) {
+        if ((msg_buf[3] & 0x80) && cj && target_erased && !page_loaded) {
+          // erased page stays erased, nothing to write or poll
+          if (skipped_pages != 0xFFFF) {
+            skipped_pages++;
+          }
+        } else if ((msg_buf[3] & 0x80) && (ce & EEPROM_SKIP_UNCHANGED) && !page_loaded) {
+          // the target holds every byte of the EEPROM page
+          if (unchanged_pages != 0xFFFF) {
+            unchanged_pages++;
+          }
+        } else if (msg_buf[3] & 0x80) {
           spi_mastertransmit_nr(msg_buf[6]);
           spi_mastertransmit_16_nr(saddress);
           spi_mastertransmit_nr(0);
-          //
-          if (!addressing_is_word) {
-            // eeprom writing, eeprom needs more time
-            delay_ms(1);
-          }
-          //check the different polling mode methods
-          ci = 150; // timeout
-          if (msg_buf[3] & 0x20 && poll_address) {
+          start = timer_now();
+          page_loaded = 0;
+          // eeprom writing, eeprom needs more time: 1ms before the polling
+          // or the timed delay starts. Not with EEPROM_RDY_BSY, it polls
+          // RDY/BSY only.
+          cj = (addressing_is_word || (ce & EEPROM_RDY_BSY)) ? 0 : 1;
+          //check the different polling mode methods, RDY/BSY polling
+          //(pend_rdop 0) with EEPROM_RDY_BSY or when none of these apply
+          pend_kind = (addressing_is_word ? WR_FLASH : WR_EEPROM) + 1;
+          pend_start = start;
+          pend_rdop = 0;
+          if (!(ce & EEPROM_RDY_BSY) && (msg_buf[3] & 0x20) && poll_address) {
             //Data value polling
-            tmp = msg_buf[8];
-            while (tmp == msg_buf[8] && ci) {
-              // The Low/High byte selection bit is
-              // bit number 3. Set high byte for uneven bytes
-              // Read data:
-              if (poll_address & 1) {
-                spi_mastertransmit_nr(msg_buf[7] | (1 << 3));
-              } else {
-                spi_mastertransmit_nr(msg_buf[7]);
-              }
-              spi_mastertransmit_16_nr(poll_address);
-              tmp = spi_mastertransmit(0x00);
-              ci--;
-            }
-            if (ci == 0) {
-              cstatus = STATUS_CMD_TOUT;
-            }
-          } else if (msg_buf[3] & 0x40) {
-            //RDY/BSY polling
-            while ((spi_mastertransmit_32(0xF0000000) & 1) && ci) {
-              ci--;
+            // The Low/High byte selection bit is
+            // bit number 3. Set high byte for uneven bytes
+            pend_rdop = (poll_address & 1) ? msg_buf[7] | (1 << 3) : msg_buf[7];
+            pend_addr = poll_address;
+            pend_poll = msg_buf[8];
+          } else if (!(ce & EEPROM_RDY_BSY) && !(msg_buf[3] & 0x40)) {
+            // simple waiting, from the end of the write instruction,
+            // the delay runs out while the answer is sent
+            pend_rdop = WR_DELAY;
+            pend_start = timer_after(start, cj + msg_buf[4]);
+          }
+          if (pend_rdop != WR_DELAY) {
+            if (cj) {
+              timer_wait(timer_after(start, cj));
             }
-            if (ci == 0) {
-              cstatus = STATUS_RDY_BSY_TOUT;
+            if (!param_early_answer || !(msg_buf[3] & 0x60)) {
+              cstatus = write_finish();
             }
-          } else {
-            // simple waiting
-            delay_ms(msg_buf[4]);
           }
+          // else answer now and wait before the next command: the next
+          // message is received while we poll and the one after it into
+          // this buffer, the result is the status of the next answer
         }
       }
       answerlen = 2;
@@ -567,52 +1563,76 @@ void programcmd(unsigned char seqnum)
       if (nbytes > 280) {
         nbytes = 280;
       }
-      //
-      i = 0;
-      SCK_LOW;
-      while (i < nbytes)
-      {
-        wdt_reset();
-        // In commands PROGRAM_FLASH and READ_FLASH "Load Extended Address"
-        // command is executed before every operation if we are programming
-        // processor with Flash memory bigger than 64k words and 64k words boundary
-        // is just crossed or new address was just loaded.
-        if (larger_than_64k && ((address & 0xFFFF) == 0 || new_address)) {
-          // load extended addr byte 0x4d
-          spi_mastertransmit(0x4d);
-          spi_mastertransmit(0x00);
-          spi_mastertransmit(extended_address);
-          spi_mastertransmit(0x00);
-          new_address = 0;
-        }
-        //Select Low or High-Byte
-        if (addressing_is_word && i & 1) {
-          spi_mastertransmit_nr(tmp | (1 << 3));
-        } else {
-          spi_mastertransmit_nr(tmp);
-        }
-
-        spi_mastertransmit_16_nr(address & 0xffff);
-        msg_buf[i + 2] = spi_mastertransmit(0);
+      read_target(&msg_buf[2], nbytes, tmp, addressing_is_word);
+      answerlen = nbytes + 3;
+      //msg_buf[0] = CMD_READ_FLASH_ISP; or CMD_READ_EEPROM_ISP
+      msg_buf[1] = STATUS_CMD_OK;
+      msg_buf[nbytes + 2] = STATUS_CMD_OK;
+      break;
 
-        if (addressing_is_word) {
-          //increment word address only when we have an uneven byte
-          if (i & 1) {
-            address++;
-            if ((address & 0xFFFF) == 0xFFFF) {
-              extended_address++;
-            }
+    case CMD_EXT_CHECKSUM_ISP:
+      // msg_buf[1] memory type
+      // msg_buf[2] read instruction
+      // msg_buf[3..6] start address, as CMD_LOAD_ADDRESS
+      // msg_buf[7..10] NumBytes
+      if (msg_buf[1] > CHECKSUM_EEPROM) {
+        answerlen = 2;
+        msg_buf[1] = STATUS_CMD_FAILED;
+        break;
+      }
+      addressing_is_word = (msg_buf[1] == CHECKSUM_FLASH);
+      tmp = msg_buf[2];
+      load_address(&msg_buf[3]);
+      rest = ((unsigned long)msg_buf[7] << 24) | ((unsigned long)msg_buf[8] << 16) |
+             ((unsigned long)msg_buf[9] << 8) | msg_buf[10];
+      crc = 0;
+      tmp2 = 1; // blank
+      while (rest) {
+        // msg_buf[16..] is scratch, the header is used up
+        nbytes = rest > 256 ? 256 : rest;
+        read_target(&msg_buf[16], nbytes, tmp, addressing_is_word);
+        crc = crc32_update(crc, &msg_buf[16], nbytes);
+        for (i = 0; i < nbytes && tmp2; i++) {
+          if (msg_buf[16 + i] != 0xFF) {
+            tmp2 = 0;
           }
-        } else {
-          address++;
         }
-        i++;
+        rest -= nbytes;
       }
-      answerlen = nbytes + 3;
-      //msg_buf[0] = CMD_READ_FLASH_ISP; or CMD_READ_EEPROM_ISP
+      answerlen = 8;
+      //msg_buf[0] = CMD_EXT_CHECKSUM_ISP;
+      msg_buf[1] = STATUS_CMD_OK;
+      msg_buf[2] = crc >> 24;
+      msg_buf[3] = crc >> 16;
+      msg_buf[4] = crc >> 8;
+      msg_buf[5] = crc;
+      msg_buf[6] = tmp2;
+      msg_buf[7] = STATUS_CMD_OK;
+      break;
+
+#if TRACE_SIZE
+    case CMD_EXT_TRACE:
+      // msg_buf[1] 1: clear after reading, optional
+      answerlen = 2;
+      i = trace_head;
+      do {
+        if (trace[i]) {
+          // command 0 marks an unused entry
+          memcpy(&msg_buf[answerlen], &trace[i], TRACE_ENTRY);
+          answerlen += TRACE_ENTRY;
+        }
+        i += TRACE_ENTRY;
+        if (i == sizeof(trace)) {
+          i = 0;
+        }
+      } while (i != trace_head);
+      if (msg_len > 1 && msg_buf[1] == 1) {
+        memset(trace, 0, sizeof(trace));
+      }
+      //msg_buf[0] = CMD_EXT_TRACE;
       msg_buf[1] = STATUS_CMD_OK;
-      msg_buf[nbytes + 2] = STATUS_CMD_OK;
       break;
+#endif
 
     case CMD_PROGRAM_LOCK_ISP:
     case CMD_PROGRAM_FUSE_ISP:
@@ -637,7 +1657,10 @@ void programcmd(unsigned char seqnum)
         if (msg_buf[1] == (ci + 1)) {
           msg_buf[2] = tmp;
         }
-        delay_ms(5);
+        // a read instruction, the target needs no time between the bytes
+        if (delay_profile == DELAY_PROFILE_CONSERVATIVE) {
+          delay_ms(5);
+        }
       }
       answerlen = 4;
       // msg_buf[0] = CMD_READ_FUSE_ISP; or CMD_READ_LOCK_ISP or ...
@@ -658,8 +1681,16 @@ void programcmd(unsigned char seqnum)
       cj = 0;
       ci = 0;
       SCK_LOW;
+      start = timer_now();
       for (cj = 0; cj < msg_buf[1]; cj++) {
-        delay_ms(5);
+        if (delay_profile == DELAY_PROFILE_CONSERVATIVE) {
+          delay_ms(5);
+        } else if (delay_profile == DELAY_PROFILE_DATASHEET && (cj & 3) == 0) {
+          // wait for a write started by the previous instruction,
+          // look at the next one before answers overwrite it
+          timer_wait(start);
+          wdelay = (cj + 4 <= msg_buf[1]) ? isp_write_delay(&msg_buf[cj + 4]) : 0;
+        }
         if (cj >= tmp2 && ci < tmp) {
           // store answer starting from msg_buf[2]
           msg_buf[ci + 2] = spi_mastertransmit(msg_buf[cj + 4]);
@@ -667,6 +1698,13 @@ void programcmd(unsigned char seqnum)
         } else {
           spi_mastertransmit_nr(msg_buf[cj + 4]);
         }
+        if ((cj & 3) == 3) {
+          start = timer_deadline(wdelay);
+        }
+      }
+      if (delay_profile == DELAY_PROFILE_DATASHEET) {
+        // the write time of the last instruction runs while the answer is sent
+        write_delay(start);
       }
       // padd with zero:
       while (ci < tmp) {
@@ -686,6 +1724,11 @@ void programcmd(unsigned char seqnum)
       msg_buf[1] = STATUS_CMD_UNKNOWN;
       break;
   }
+  if (deferred_status != STATUS_CMD_OK) {
+    // a page write answered early did not finish in time
+    msg_buf[1] = deferred_status;
+    deferred_status = STATUS_CMD_OK;
+  }
   transmit_answer(seqnum, answerlen);
 
 }
@@ -737,9 +1780,56 @@ void terminalmode_next_line(void)
   uart_sendchar('E');
 }
 
+#if TRACE_SIZE
+// Print v as 2 hex digits
+static void terminalmode_hex(unsigned char v)
+{
+  unsigned char c, n = 2;
+
+  while (n--) {
+    c = n ? v >> 4 : v & 0x0F;
+    uart_sendchar(c < 10 ? '0' + c : 'A' - 10 + c);
+  }
+}
+
+// The trace of the last messages, oldest first
+static void terminalmode_trace(void)
+{
+  unsigned char i = trace_head;
+  unsigned char j;
+
+  uart_sendstr_p(PSTR("Last commands (hex, time in 1/8 ms):"));
+  terminalmode_next_line();
+  uart_sendstr_p(PSTR("cmd seq st  addr  time"));
+  terminalmode_next_line();
+  do {
+    if (trace[i]) {
+      // entry bytes: cmd, seq, status, addr (2), time (2)
+      for (j = 0; j < TRACE_ENTRY; j++) {
+        terminalmode_hex(trace[i + j]);
+        if (j < 3 || j == 4) {
+          uart_sendstr_p(PSTR("  "));
+        }
+      }
+      terminalmode_next_line();
+    }
+    i += TRACE_ENTRY;
+    if (i == sizeof(trace)) {
+      i = 0;
+    }
+  } while (i != trace_head);
+}
+#else
+#define terminalmode_trace()
+#endif
+
 void terminalmode(unsigned char chr_nl)
 {
   unsigned char i;
+  // msg_buf is used as scratch buffer below
+  uart_tx_wait();
+  // all input goes to uart_getchar() now
+  terminal_active = 1;
   // Init terminal
   uart_sendstr_p(terminal_init);
   // version string of this software
@@ -752,6 +1842,7 @@ void terminalmode(unsigned char chr_nl)
   utoa(v, (char *)msg_buf, 10);
   uart_sendstr((char *)msg_buf);
   terminalmode_next_line();
+  terminalmode_trace();
 
   uart_sendstr_p(PSTR("Enter SW Version Major in hex ["));
   utoa(CONFIG_PARAM_SW_MAJOR, (char *)msg_buf, 16);
@@ -786,6 +1877,7 @@ void terminalmode(unsigned char chr_nl)
   uart_sendstr((char *)msg_buf);
   uart_sendstr_p(PSTR(" (hex)\r\n"));
   uart_sendstr_p(PSTR("Ready. Just close the terminal. No reset needed.\r\n"));
+  terminal_active = 0;
 }
 
 // Generate a clock signal on pin OC1B/PB2, using pwm with 50% duty cycle.
@@ -823,16 +1915,20 @@ int main(void)
   unsigned char ch;
   unsigned char prev_ch = 0;
   unsigned char chr_nl = 0;
-  unsigned char msgparsestate;
-  unsigned char cksum = 0;
   unsigned char seqnum = 0;
-  unsigned int msglen = 0;
+  unsigned char cls;
+  unsigned char *buf;
   unsigned int i = 0;
+  uint16_t t;
 
   // wait for the USB to startup, and the electrolytic capacitor
   // to charge before blinking:
   LED_INIT;
   LED_OFF;
+  // delays and the target voltage sampling need the timer tick
+  timer_init();
+  analog_init();
+  sei();
   delay_ms(200);
   delay_ms(200);
   // indicate with LED that device is working:
@@ -845,15 +1941,14 @@ int main(void)
     delay_ms(125);
   }
   uart_init();
+  write_time_init();
   LED_OFF;
-  sei();
 
   // timeout the watchdog after 2 sec:
   wdt_enable(WDTO_2S);
   wdt_reset();
 
   clk_start();
-  msgparsestate = MSG_IDLE;
   // default values:
   CONFIG_PARAM_SW_MINOR = D_CONFIG_PARAM_SW_MINOR;
   CONFIG_PARAM_SW_MAJOR = D_CONFIG_PARAM_SW_MAJOR;
@@ -862,25 +1957,109 @@ int main(void)
     CONFIG_PARAM_SW_MINOR = eeprom_read_byte(EEPROM_MINOR);
     CONFIG_PARAM_SW_MAJOR = eeprom_read_byte(EEPROM_MAJOR);
   }
+  ch = eeprom_read_byte(EEPROM_BAUD);
+  if (ch != UART_BAUD_115200 && ch <= UART_BAUD_576000) {
+    uart_set_baud(ch);
+    baud_trial = BAUD_TRIAL_WAIT;
+  }
+  delay_profile = eeprom_read_byte(EEPROM_DELAY_PROFILE);
+  if (delay_profile > DELAY_PROFILE_ZERO) {
+    delay_profile = DELAY_PROFILE_CONSERVATIVE;
+  }
   while (1) {
-    if (msgparsestate == MSG_IDLE) {
-      ch = uart_getchar(1);
-    } else {
-      ch = uart_getchar(0);
+    if (msg_rx_ready) {
+      // the previous answer may still be sent from msg_buf, which
+      // becomes the receive buffer now
+      uart_tx_wait();
+      buf = msg_buf;
+      msg_buf = msg_rx_buf;
+      msg_rx_buf = buf;
+      ch = msg_rx_ready;
+      seqnum = msg_rx_seqnum;
+      msg_len = msg_rx_len;
+      wdt_reset();
+      if (ch == 1) {
+        // the RX interrupt may start on the next message after the
+        // bytes it held back meanwhile
+        msg_rx_ready = MSG_RX_HOLD;
+        msg_rx_held();
+        // message correct, process it
+        baud_trial = BAUD_TRIAL_NONE;
+        cls = perf_class();
+        if (cls != PERF_NONE) {
+          trace_begin(seqnum);
+        }
+        t = timer_now();
+        programcmd(seqnum);
+        if (cls != PERF_NONE) {
+          t = timer_now() - t;
+          perf_record(cls, t);
+          trace_end(t);
+        }
+        if (baud_next) {
+          uart_set_baud(baud_next - 1);
+          baud_next = 0;
+          baud_trial = BAUD_TRIAL_RUN;
+          baud_trial_end = millis() + BAUD_TRIAL_MS;
+        }
+      } else {
+        msg_rx_rescan();
+        if (perf_cksum_errors != 0xFF) {
+          perf_cksum_errors++;
+        }
+        msg_buf[0] = ANSWER_CKSUM_ERROR;
+        msg_buf[1] = STATUS_CKSUM_ERROR;
+        trace_begin(seqnum);
+        trace_end(0);
+        transmit_answer(seqnum, 2);
+      }
+      prev_ch = 0;
+      i = 0;
+      continue;
+    }
+    if (baud_trial == BAUD_TRIAL_WAIT && (msg_rx_state != MSG_IDLE || uart_rx_available() ||
+                                          uart_rx_framing_errors())) {
+      baud_trial = BAUD_TRIAL_RUN;
+      baud_trial_end = millis() + BAUD_TRIAL_MS;
+    }
+    if (baud_trial == BAUD_TRIAL_RUN && (int16_t)(millis() - baud_trial_end) >= 0) {
+      // the host does not talk at this rate
+      baud_trial = BAUD_TRIAL_NONE;
+      uart_set_baud(UART_BAUD_115200);
+      cli();
+      msg_rx_state = MSG_IDLE;
+      sei();
+      uart_flushRXbuf();
+    }
+    if (msg_rx_state != MSG_IDLE) {
+      cli();
+      if (msg_rx_state != MSG_IDLE && (uint16_t)(millis() - msg_rx_time) > MSG_RX_TIMEOUT_MS) {
+        // the rest of the frame is not coming
+        msg_rx_state = MSG_IDLE;
+        if (msg_rx_timeouts != 0xFF) {
+          msg_rx_timeouts++;
+        }
+      }
+      sei();
     }
-    // parse message according to appl. note AVR068 table 3-1:
-    if (msgparsestate == MSG_IDLE && ch == MESSAGE_START) {
-      msgparsestate = MSG_WAIT_SEQNUM;
-      cksum = ch ^ 0;
+    if (!uart_rx_available()) {
+      if (park_state == PARK_ACTIVE &&
+          (param_reconnect_grace == 0 || (int16_t)(millis() - park_until) >= 0)) {
+        park_release();
+      }
+      // a message that stops half way times out (MSG_RX_TIMEOUT_MS), the
+      // watchdog is the last resort
+      uart_idle(msg_rx_state == MSG_IDLE);
       continue;
     }
+    ch = uart_getchar(1);
     // The special avrusb500 terminal mode.
     // Just connect a serial terminal and press enter twice.
     // Both Windows and Linux send normally \r (=0xd) as the
     // only line end character. It is however possible to configure
     // \r\n as line end in some serial terminals. Therefore we
     // must handle it.
-    if (msgparsestate == MSG_IDLE && (ch == '\r' || ch == '\n')) {
+    if (ch == '\r' || ch == '\n') {
       i++;
       if (chr_nl == 0 && ch == '\n' && prev_ch == '\r') {
         // terminal sends \r\n for new line
@@ -900,63 +2079,10 @@ int main(void)
           i = 0;
         }
       }
-      continue;
-    }
-    if (msgparsestate == MSG_WAIT_SEQNUM) {
-      seqnum = ch;
-      cksum ^= ch;
-      msgparsestate = MSG_WAIT_SIZE1;
-      continue;
-    }
-    if (msgparsestate == MSG_WAIT_SIZE1) {
-      cksum ^= ch;
-      msglen = ch << 8;
-      msgparsestate = MSG_WAIT_SIZE2;
-      continue;
-    }
-    if (msgparsestate == MSG_WAIT_SIZE2) {
-      cksum ^= ch;
-      msglen |= (ch & 0xff);
-      msgparsestate = MSG_WAIT_TOKEN;
-      continue;
-    }
-    if (msgparsestate == MSG_WAIT_TOKEN) {
-      cksum ^= ch;
-      if (ch == TOKEN) {
-        msgparsestate = MSG_WAIT_MSG;
-        i = 0;
-      } else {
-        msgparsestate = MSG_IDLE;
-      }
-      continue;
-    }
-    if (msgparsestate == MSG_WAIT_MSG && i < msglen && i < 280) {
-      cksum ^= ch;
-      msg_buf[i] = ch;
-      i++;
-      wdt_reset();
-      if (i == msglen) {
-        msgparsestate = MSG_WAIT_CKSUM;
-      }
-      continue;
-    }
-    if (msgparsestate == MSG_WAIT_CKSUM) {
-      if (ch == cksum && msglen > 0) {
-        // message correct, process it
-        wdt_reset();
-        programcmd(seqnum);
-      } else {
-        msg_buf[0] = ANSWER_CKSUM_ERROR;
-        msg_buf[1] = STATUS_CKSUM_ERROR;
-        transmit_answer(seqnum, 2);
-      }
-      // no continue here, set state=MSG_IDLE
+    } else {
+      prev_ch = 0;
+      i = 0;
     }
-    msgparsestate = MSG_IDLE;
-    msglen = 0;
-    seqnum = 0;
-    prev_ch = 0;
-    i = 0;
   }
   return (0);
 }
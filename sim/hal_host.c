@@ -0,0 +1,373 @@
+/* vim: set sw=2 ts=2 si et: */
+/*********************************************
+* Host build: hardware abstraction and simulated peripherals
+*
+* The firmware runs natively and talks to the outside world through a
+* pseudo terminal. Its pins and registers are the variables below.
+* Simulated time is kept in CPU cycles and advanced by delays, SPI
+* transfers and idle waits; it is paced to the wall clock so host tools
+* (avrdude, sim/bench.py) see realistic timing:
+*   - UART bytes leave and arrive at the configured baud rate
+*   - SPI bytes take 16 SCK half periods plus call overhead
+*   - delays take their nominal time
+*
+* Environment:
+*   AVRUSB_SIM_LINK=path   create a symlink to the pty
+*   AVRUSB_SIM_VTARGET=n   target voltage * 10 (default 50)
+*
+* Author: Clancy Palmer
+* License: GPL
+* Copyright: GPL
+**********************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "../hal.h"
+#include "sim.h"
+
+#define SIM_REG_DEF(r) volatile uint8_t r;
+SIM_REGS(SIM_REG_DEF)
+
+// CPU cycles spent around each SPI byte by the firmware (call, setup)
+#define SPI_OVERHEAD    24
+// Run ahead of the wall clock by at most this many cycles
+#define PACE_SLACK      (F_CPU / 2000)
+
+static int pty = -1;
+static uint64_t cycles = 0;
+static struct timespec t0;
+static int in_service = 0;
+
+static uint8_t rx_queue[4096];
+static unsigned int rx_len = 0, rx_pos = 0;
+static uint64_t rx_next = 0;
+static uint64_t tx_next = 0;     // the byte in the shift register is on the wire
+static int tx_shift = -1;        // byte in the shift register, -1 = idle
+static uint64_t t0_next = 0;
+static uint8_t eeprom[512];
+
+static unsigned long n_spi, n_rx, n_tx;
+
+static uint64_t wall_cycles(void)
+{
+  struct timespec t;
+  int64_t ns;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  ns = (int64_t)(t.tv_sec - t0.tv_sec) * 1000000000LL + (t.tv_nsec - t0.tv_nsec);
+  return (uint64_t)ns * (F_CPU / 1000000UL) / 1000;
+}
+
+uint64_t sim_now(void)
+{
+  return cycles;
+}
+
+/* duration of one UART character (start, 8 data, stop) in CPU cycles */
+static uint64_t uart_char_cycles(void)
+{
+  unsigned int ubrr = ((UBRR0H & 0x0F) << 8) | UBRR0L;
+  return 10ULL * ((UCSR0A & (1 << U2X0)) ? 8 : 16) * (ubrr + 1);
+}
+
+static void pty_read(uint64_t timeout)
+{
+  struct pollfd p = { pty, POLLIN, 0 };
+  struct timespec d;
+  uint64_t ns = timeout * 1000 / (F_CPU / 1000000UL);
+  ssize_t n;
+
+  if (rx_pos == rx_len) {
+    rx_pos = rx_len = 0;
+  }
+  d.tv_sec = ns / 1000000000ULL;
+  d.tv_nsec = ns % 1000000000ULL;
+  if (rx_len == sizeof(rx_queue) || ppoll(&p, 1, &d, NULL) <= 0) {
+    return;
+  }
+  n = read(pty, rx_queue + rx_len, sizeof(rx_queue) - rx_len);
+  if (n > 0) {
+    uint64_t now = wall_cycles();
+    if (now < cycles) {
+      now = cycles;
+    }
+    if (rx_pos == rx_len && rx_next < now) {
+      // first byte of a burst, complete after its frame time. ppoll()
+      // may have slept, count from the wall clock
+      rx_next = now + uart_char_cycles();
+    }
+    rx_len += n;
+  }
+}
+
+/* 1.1V reference, 47k/220k divider, conversion done immediately */
+static void sim_adc(void)
+{
+  const char *v = getenv("AVRUSB_SIM_VTARGET");
+  unsigned int vt = v ? (unsigned int)atoi(v) : 50;
+  unsigned int a = vt * 1024UL * 47 / (267 * 11);
+
+  if (!(ADCSRA & (1 << ADEN))) {
+    return;
+  }
+  ADCL = a & 0xFF;
+  ADCH = a >> 8;
+  ADCSRA &= ~(1 << ADSC);
+  if (ADCSRA & (1 << ADIE)) {
+    ADC_vect();
+  } else {
+    ADCSRA |= (1 << ADIF);
+  }
+}
+
+/* run the UART and ADC up to the current simulated time */
+static void sim_service(void)
+{
+  if (in_service) {
+    return;
+  }
+  in_service = 1;
+  pty_read(0);
+  while (rx_pos < rx_len && rx_next <= cycles) {
+    rx_next += uart_char_cycles();
+    n_rx++;
+    if ((UCSR0B & (1 << RXEN0)) == 0) {
+      rx_pos++;
+      continue;
+    }
+    if (UCSR0A & (1 << RXC0)) {
+      // previous byte not read yet
+      UCSR0A |= (1 << DOR0);
+    }
+    UDR0 = rx_queue[rx_pos++];
+    UCSR0A |= (1 << RXC0);
+    if (UCSR0B & (1 << RXCIE0)) {
+      USART_RX_vect();
+      UCSR0A &= ~((1 << RXC0) | (1 << DOR0) | (1 << FE0));
+    }
+  }
+  // the host sees a byte when its frame is complete, not when the
+  // firmware writes UDR0, like the real UART
+  while (1) {
+    if (tx_shift >= 0 && tx_next <= cycles) {
+      uint8_t c = tx_shift;
+      if (write(pty, &c, 1) == 1) {
+        n_tx++;
+      }
+      tx_shift = -1;
+    }
+    if (tx_shift >= 0 || (UCSR0B & (1 << UDRIE0)) == 0) {
+      break;
+    }
+    USART_UDRE_vect();
+    if ((UCSR0B & (1 << UDRIE0)) == 0) {
+      break;
+    }
+    // the interrupt wrote a byte
+    tx_shift = UDR0;
+    tx_next = (tx_next > cycles ? tx_next : cycles) + uart_char_cycles();
+  }
+  if ((TCCR0A & (1 << WGM01)) && (TCCR0B & 7)) {
+    // Timer0 in CTC mode
+    static const unsigned int prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+    uint64_t period = (uint64_t)(OCR0A + 1) * prescale[TCCR0B & 7];
+    if (t0_next == 0) {
+      t0_next = cycles + period;
+    }
+    while (t0_next <= cycles) {
+      t0_next += period;
+      if (TIMSK0 & (1 << OCIE0A)) {
+        TIMER0_COMPA_vect();
+      } else {
+        TIFR0 |= (1 << OCF0A);
+      }
+      if ((ADCSRA & (1 << ADATE)) && (ADCSRB & 7) == ((1 << ADTS1) | (1 << ADTS0))) {
+        // ADC auto trigger on compare match A
+        sim_adc();
+      }
+    }
+    TCNT0 = (period - (t0_next - cycles)) / prescale[TCCR0B & 7];
+  }
+  if (ADCSRA & (1 << ADSC)) {
+    sim_adc();
+  }
+  in_service = 0;
+}
+
+void sim_advance(uint64_t n)
+{
+  uint64_t w;
+
+  cycles += n;
+  sim_service();
+  w = wall_cycles();
+  if (cycles > w + PACE_SLACK) {
+    struct timespec d;
+    uint64_t ns = (cycles - w) * 1000 / (F_CPU / 1000000UL);
+    d.tv_sec = ns / 1000000000ULL;
+    d.tv_nsec = ns % 1000000000ULL;
+    nanosleep(&d, NULL);
+  }
+}
+
+/* move simulated time up to the wall clock. While received bytes are
+ * queued only in steps shorter than a UART character, so that main()
+ * runs between two bytes like on the real chip */
+static void catch_up(void)
+{
+  uint64_t w = wall_cycles();
+  uint64_t step = uart_char_cycles() / 2;
+
+  if (cycles >= w) {
+    return;
+  }
+  if (rx_pos < rx_len && w - cycles > step) {
+    cycles += step;
+  } else {
+    cycles = w;
+  }
+}
+
+/* the firmware waits for hardware: let the wall clock catch up */
+void hal_idle(void)
+{
+  uint64_t timeout = F_CPU / 1000;
+
+  if ((rx_pos < rx_len && rx_next > cycles) || (UCSR0B & (1 << UDRIE0)) || tx_shift >= 0) {
+    // something is scheduled, just let time pass
+    timeout = 0;
+  } else if (t0_next) {
+    // timer_now() counts 1/8 ms steps of TCNT0, do not sleep past one
+    timeout = F_CPU / 8000;
+  }
+  pty_read(timeout);
+  catch_up();
+  sim_advance(F_CPU / 100000);
+}
+
+unsigned char hal_spi_xfer(unsigned char data, unsigned int half)
+{
+  uint8_t rx;
+  int in_reset = (DDRB & (1 << DDB0)) && !(PORTB & (1 << PB0)) &&
+                 (DDRD & (1 << DDD5)) && !(PORTD & (1 << PD5));
+
+  n_spi++;
+  sim_advance(16ULL * half + SPI_OVERHEAD);
+  rx = target_spi(data, in_reset, cycles);
+  return rx;
+}
+
+void _delay_ms(double ms)
+{
+  sim_advance((uint64_t)(ms * (F_CPU / 1000)));
+}
+
+void _delay_us(double us)
+{
+  sim_advance((uint64_t)(us * (F_CPU / 1000000)));
+}
+
+void _delay_loop_1(uint8_t count)
+{
+  sim_advance(3ULL * (count ? count : 256));
+}
+
+void _delay_loop_2(uint16_t count)
+{
+  sim_advance(4ULL * (count ? count : 65536));
+}
+
+uint8_t eeprom_read_byte(const uint8_t *p)
+{
+  return eeprom[(uintptr_t)p % sizeof(eeprom)];
+}
+
+void eeprom_write_byte(uint8_t *p, uint8_t value)
+{
+  eeprom[(uintptr_t)p % sizeof(eeprom)] = value;
+  sim_advance(F_CPU / 300); // 3.3ms
+}
+
+void eeprom_update_byte(uint8_t *p, uint8_t value)
+{
+  if (eeprom_read_byte(p) != value) {
+    eeprom_write_byte(p, value);
+  }
+}
+
+char *ultoa(unsigned long value, char *s, int radix)
+{
+  char tmp[33];
+  int i = 0, j = 0;
+  do {
+    int d = value % radix;
+    tmp[i++] = d < 10 ? '0' + d : 'a' + d - 10;
+    value /= radix;
+  } while (value);
+  while (i) {
+    s[j++] = tmp[--i];
+  }
+  s[j] = 0;
+  return s;
+}
+
+char *utoa(unsigned int value, char *s, int radix)
+{
+  return ultoa(value, s, radix);
+}
+
+static void sim_exit(int sig)
+{
+  (void)sig;
+  fprintf(stderr, "sim: %.3fs simulated, %lu SPI bytes, %lu bytes received, %lu bytes sent\n",
+          (double)cycles / F_CPU, n_spi, n_rx, n_tx);
+  target_report();
+  _exit(0);
+}
+
+__attribute__((constructor))
+static void sim_init(void)
+{
+  struct termios t;
+  const char *link = getenv("AVRUSB_SIM_LINK");
+  int slave;
+
+  pty = posix_openpt(O_RDWR | O_NOCTTY);
+  if (pty < 0 || grantpt(pty) || unlockpt(pty)) {
+    perror("sim: pty");
+    exit(1);
+  }
+  // keep the slave open so the master does not see a hangup between clients
+  slave = open(ptsname(pty), O_RDWR | O_NOCTTY);
+  if (slave < 0 || tcgetattr(slave, &t)) {
+    perror("sim: pty slave");
+    exit(1);
+  }
+  cfmakeraw(&t);
+  tcsetattr(slave, TCSANOW, &t);
+  if (link) {
+    unlink(link);
+    if (symlink(ptsname(pty), link)) {
+      perror("sim: symlink");
+    }
+  }
+  printf("%s\n", ptsname(pty));
+  fflush(stdout);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  UCSR0A = (1 << UDRE0);
+  target_init();
+  signal(SIGINT, sim_exit);
+  signal(SIGTERM, sim_exit);
+}
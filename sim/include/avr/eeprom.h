@@ -0,0 +1,10 @@
+/* vim: set sw=2 ts=2 si et: */
+/* Host build: EEPROM emulated in sim/hal_host.c */
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+#include <stdint.h>
+#define EEMEM
+extern uint8_t eeprom_read_byte(const uint8_t *p);
+extern void eeprom_write_byte(uint8_t *p, uint8_t value);
+extern void eeprom_update_byte(uint8_t *p, uint8_t value);
+#endif /* SIM_AVR_EEPROM_H */
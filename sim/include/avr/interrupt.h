@@ -0,0 +1,16 @@
+/* vim: set sw=2 ts=2 si et: */
+/* Host build: interrupt handlers are plain functions called by sim/hal_host.c */
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+#include <avr/io.h>
+
+#define ISR(vector)       void vector(void); void vector(void)
+#define sei()
+#define cli()
+
+extern void USART_RX_vect(void);
+extern void USART_UDRE_vect(void);
+extern void TIMER0_COMPA_vect(void);
+extern void ADC_vect(void);
+
+#endif /* SIM_AVR_INTERRUPT_H */
@@ -0,0 +1,123 @@
+/* vim: set sw=2 ts=2 si et: */
+/*********************************************
+* Host build: ATMega88 registers used by the firmware as plain
+* variables, defined and serviced in sim/hal_host.c
+*
+* Author: Clancy Palmer
+* License: GPL
+* Copyright: GPL
+**********************************************/
+
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+#include <stdint.h>
+
+#define SIM_REGS(X) \
+  X(PINB) X(DDRB) X(PORTB) X(PINC) X(DDRC) X(PORTC) X(PIND) X(DDRD) X(PORTD) \
+  X(UCSR0A) X(UCSR0B) X(UCSR0C) X(UBRR0L) X(UBRR0H) X(UDR0) \
+  X(ADCL) X(ADCH) X(ADCSRA) X(ADCSRB) X(ADMUX) X(DIDR0) \
+  X(TCCR0A) X(TCCR0B) X(TCNT0) X(OCR0A) X(OCR0B) X(TIMSK0) X(TIFR0) \
+  X(TCCR1A) X(TCCR1B) X(TCNT1H) X(TCNT1L) X(ICR1H) X(ICR1L) X(OCR1BH) X(OCR1BL) \
+  X(TCCR2A) X(TCCR2B) X(TCNT2) X(OCR2A) X(OCR2B) X(TIMSK2) X(TIFR2) \
+  X(SPCR) X(SPSR) X(SPDR) X(GPIOR0) X(GPIOR1) X(GPIOR2) X(SREG)
+
+#define SIM_REG_DECL(r) extern volatile uint8_t r;
+SIM_REGS(SIM_REG_DECL)
+
+#define _BV(bit)          (1 << (bit))
+
+// Port bits
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PINB0 0
+#define PINB4 4
+#define PIND2 2
+#define PIND3 3
+#define PIND4 4
+#define PIND5 5
+#define DDB0 0
+#define DDB1 1
+#define DDB2 2
+#define DDB3 3
+#define DDB4 4
+#define DDB5 5
+#define DDD2 2
+#define DDD3 3
+#define DDD4 4
+#define DDD5 5
+
+// USART0
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define FE0 4
+#define DOR0 3
+#define UPE0 2
+#define U2X0 1
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ01 2
+#define UCSZ00 1
+
+// ADC
+#define REFS1 7
+#define REFS0 6
+#define ADLAR 5
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+#define ADTS2 2
+#define ADTS1 1
+#define ADTS0 0
+
+// Timers
+#define COM1B1 5
+#define COM1B0 4
+#define WGM11 1
+#define WGM12 3
+#define WGM13 4
+#define CS10 0
+#define WGM01 1
+#define WGM00 0
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define OCIE0A 1
+#define OCF0A 1
+#define WGM21 1
+#define WGM20 0
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define OCIE2A 1
+#define OCF2A 1
+
+// SPI
+#define SPIE 7
+#define SPE 6
+#define DORD 5
+#define MSTR 4
+#define CPOL 3
+#define CPHA 2
+#define SPR1 1
+#define SPR0 0
+#define SPIF 7
+#define SPI2X 0
+
+#endif /* SIM_AVR_IO_H */
@@ -0,0 +1,14 @@
+/* vim: set sw=2 ts=2 si et: */
+/* Host build: program memory is ordinary memory */
+#ifndef SIM_AVR_PGMSPACE_H
+#define SIM_AVR_PGMSPACE_H
+#include <stdint.h>
+#include <string.h>
+#define PROGMEM
+#define PSTR(s)           (s)
+#define pgm_read_byte(p)  (*(const uint8_t *)(p))
+#define pgm_read_word(p)  (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+#define memcpy_P          memcpy
+#define strcpy_P          strcpy
+#endif /* SIM_AVR_PGMSPACE_H */
@@ -0,0 +1,8 @@
+/* vim: set sw=2 ts=2 si et: */
+/* Host build: no watchdog */
+#ifndef SIM_AVR_WDT_H
+#define SIM_AVR_WDT_H
+#define WDTO_2S           7
+#define wdt_reset()
+#define wdt_enable(t)
+#endif /* SIM_AVR_WDT_H */
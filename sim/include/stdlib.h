@@ -0,0 +1,8 @@
+/* vim: set sw=2 ts=2 si et: */
+/* Host build: avr-libc extensions to stdlib.h */
+#ifndef SIM_STDLIB_H
+#define SIM_STDLIB_H
+#include_next <stdlib.h>
+extern char *utoa(unsigned int value, char *s, int radix);
+extern char *ultoa(unsigned long value, char *s, int radix);
+#endif /* SIM_STDLIB_H */
@@ -0,0 +1,10 @@
+/* vim: set sw=2 ts=2 si et: */
+/* Host build: delays advance the simulated clock */
+#ifndef SIM_UTIL_DELAY_H
+#define SIM_UTIL_DELAY_H
+#include <stdint.h>
+extern void _delay_ms(double ms);
+extern void _delay_us(double us);
+extern void _delay_loop_1(uint8_t count);
+extern void _delay_loop_2(uint16_t count);
+#endif /* SIM_UTIL_DELAY_H */
@@ -0,0 +1,25 @@
+/* vim: set sw=2 ts=2 si et: */
+/*********************************************
+* Host build: simulated hardware around the firmware
+*
+* Author: Clancy Palmer
+* License: GPL
+* Copyright: GPL
+**********************************************/
+
+#ifndef SIM_H
+#define SIM_H
+#include <stdint.h>
+
+// Simulated time in programmer CPU cycles (F_CPU), host build only
+extern uint64_t sim_now(void);
+extern void sim_advance(uint64_t cycles);
+
+// Simulated ISP target (target.c), one SPI byte per call
+extern void target_init(void);
+extern uint8_t target_spi(uint8_t in, int in_reset, uint64_t now);
+extern uint8_t target_spi_begin(int in_reset, uint64_t now);
+extern void target_spi_end(uint8_t in, uint64_t now);
+extern void target_report(void);
+
+#endif /* SIM_H */
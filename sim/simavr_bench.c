@@ -0,0 +1,610 @@
+/* vim: set sw=2 ts=2 si et: */
+/*********************************************
+* Cycle accurate benchmark of the real firmware (main.out) in simavr
+*
+* The ATMega88 runs the unmodified ELF at 18.432MHz. A scripted host
+* feeds STK500v2 frames into USART0 and a bit level SPI slave on
+* PD2 (SCK), PD4 (MOSI) and PD3 (MISO) connects the simulated
+* ATmega328P from target.c. Every instruction is attributed to the
+* function it belongs to (symbols from avr-nm), which gives the cycle
+* cost of the hot paths. It fails if a function a group is made of was
+* inlined (missing from main.sym or never executed). Results are printed as a JSON array, see
+* tools/benchcmp.py for the regression check done by 'make bench'.
+*
+* Usage: simavr_bench main.out main.sym > bench.json
+*
+* Only the default bit-bang wiring is supported, not SPI_HW.
+*
+* Author: Clancy Palmer
+* License: GPL
+* Copyright: GPL
+**********************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_irq.h>
+#include <sim_io.h>
+#include <avr_uart.h>
+#include <avr_ioport.h>
+#include "sim.h"
+
+// ATMega88 data space addresses
+#define DDRB_ADDR       0x24
+#define PORTB_ADDR      0x25
+#define DDRD_ADDR       0x2A
+#define PORTD_ADDR      0x2B
+
+#define MAX_SYMBOLS     512
+#define FLASH_READ_PAGES 128   // 32KB of the simulated ATmega328P
+#define MAX_FRAME       300
+
+static avr_t *avr;
+static avr_irq_t *miso_irq;
+
+/* ---------- profiling ---------- */
+
+enum { G_SPI, G_PARSER, G_PROGRAMCMD, G_ANSWER, G_RX_ISR, G_WAIT, G_DELAY, G_OTHER, G_COUNT };
+static const char *group_name[G_COUNT] = {
+  "spi", "parser", "programcmd", "answer", "rx_isr", "wait", "delay", "other"
+};
+
+// Functions whose cycles make up the groups. gcc may inline a function
+// into its caller at -Os, its cycles would then silently go to another
+// group: the run fails if a required one is not in main.sym, or was
+// never executed if it has to run. Static helpers that may well be
+// inlined into a function of the same group are optional.
+#define SYM_OPTIONAL    0
+#define SYM_REQUIRED    1       // must be in main.sym
+#define SYM_RUN         3       // must also execute during the run
+static const struct {
+  const char *name;
+  int group;
+  int need;
+} known[] = {
+  { "spi_mastertransmit", G_SPI,        SYM_RUN },
+  { "uart_rx_msg",        G_PARSER,     SYM_RUN },
+  { "msg_rx_byte",        G_PARSER,     SYM_OPTIONAL },
+  { "msg_rx_held",        G_PARSER,     SYM_OPTIONAL },
+  { "msg_rx_rescan",      G_PARSER,     SYM_OPTIONAL },
+  { "msg_rx_resync",      G_PARSER,     SYM_OPTIONAL },
+  { "programcmd",         G_PROGRAMCMD, SYM_RUN },
+  { "transmit_answer",    G_ANSWER,     SYM_RUN },
+  { "uart_sendbuf",       G_ANSWER,     SYM_RUN },
+  { "uart_sendchar",      G_ANSWER,     SYM_RUN },
+  { "__vector_19",        G_ANSWER,     SYM_RUN },
+  { "__vector_18",        G_RX_ISR,     SYM_RUN },
+  { "main",               G_WAIT,       SYM_RUN },      // main loop, idles in uart_idle()
+  { "uart_idle",          G_WAIT,       SYM_RUN },
+  { "uart_getchar",       G_WAIT,       SYM_REQUIRED },
+  { "uart_tx_wait",       G_WAIT,       SYM_REQUIRED },
+  { "tx_blk_wait",        G_WAIT,       SYM_OPTIONAL },
+  { "delay_ms",           G_DELAY,      SYM_REQUIRED },
+  { "timer_wait",         G_DELAY,      SYM_RUN },      // the busy wait of delay_ms() and
+  { "timer_expired",      G_DELAY,      SYM_REQUIRED }, // of the deadlines of timeout.c
+  { "timer_now",          G_DELAY,      SYM_RUN },
+};
+#define NKNOWN (sizeof(known) / sizeof(known[0]))
+
+static struct {
+  uint32_t addr;
+  int group;
+  int known;            // index into known[], -1 if none
+} sym[MAX_SYMBOLS];
+static int nsym = 0;
+static uint64_t group_cycles[G_COUNT];
+static uint64_t known_cycles[NKNOWN];   // whole run, for the SYM_RUN check
+
+static int symbol_known(const char *name)
+{
+  unsigned int i;
+  for (i = 0; i < NKNOWN; i++) {
+    if (!strcmp(name, known[i].name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int symbol_group(const char *name, int k)
+{
+  if (k >= 0) {
+    return known[k].group;
+  }
+  if (!strncmp(name, "spi_", 4)) {
+    return G_SPI;
+  }
+  return G_OTHER;
+}
+
+/* read "avr-nm -n" output, text symbols only, and check that the
+ * required functions are there */
+static void load_symbols(const char *file)
+{
+  char line[256], name[200], type;
+  unsigned int addr, i;
+  int found[NKNOWN] = { 0 }, missing = 0;
+  FILE *f = fopen(file, "r");
+
+  if (!f) {
+    perror(file);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%x %c %199s", &addr, &type, name) != 3) {
+      continue;
+    }
+    if (type != 'T' && type != 't') {
+      continue;
+    }
+    if (nsym == MAX_SYMBOLS) {
+      fprintf(stderr, "simavr_bench: more than %d symbols in %s\n", MAX_SYMBOLS, file);
+      exit(1);
+    }
+    sym[nsym].addr = addr;
+    sym[nsym].known = symbol_known(name);
+    sym[nsym].group = symbol_group(name, sym[nsym].known);
+    if (sym[nsym].known >= 0) {
+      found[sym[nsym].known] = 1;
+    }
+    nsym++;
+  }
+  fclose(f);
+  for (i = 0; i < NKNOWN; i++) {
+    if ((known[i].need & SYM_REQUIRED) && !found[i]) {
+      fprintf(stderr, "simavr_bench: %s not in %s (inlined?), its cycles would go to another group\n",
+              known[i].name, file);
+      missing++;
+    }
+  }
+  if (missing) {
+    exit(1);
+  }
+}
+
+/* fail if a function that has to run never did, it was inlined into
+ * its callers and only an out of line copy is left */
+static void check_known_cycles(void)
+{
+  unsigned int i;
+  int missing = 0;
+
+  for (i = 0; i < NKNOWN; i++) {
+    if (known[i].need == SYM_RUN && known_cycles[i] == 0) {
+      fprintf(stderr, "simavr_bench: %s never executed (inlined?), its cycles went to another group\n",
+              known[i].name);
+      missing++;
+    }
+  }
+  if (missing) {
+    exit(1);
+  }
+}
+
+/* symbol index of pc, -1 below the first one */
+static int pc_symbol(uint32_t pc)
+{
+  int lo = 0, hi = nsym - 1;
+  if (nsym == 0 || pc < sym[0].addr) {
+    return -1;
+  }
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (sym[mid].addr <= pc) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+/* ---------- SPI slave ---------- */
+
+static struct {
+  int sck;
+  uint8_t in, out;
+  int bit;
+  // edge statistics
+  uint64_t last_rise, rise_of_byte, last_byte_rise;
+  uint64_t period_sum, high_sum, byte_sum;
+  unsigned long periods, highs, bytes, byte_gaps;
+} spi;
+
+static int target_in_reset(void)
+{
+  return (avr->data[DDRB_ADDR] & (1 << 0)) && !(avr->data[PORTB_ADDR] & (1 << 0)) &&
+         (avr->data[DDRD_ADDR] & (1 << 5)) && !(avr->data[PORTD_ADDR] & (1 << 5));
+}
+
+static void spi_stats_reset(void)
+{
+  spi.period_sum = spi.high_sum = spi.byte_sum = 0;
+  spi.periods = spi.highs = spi.bytes = spi.byte_gaps = 0;
+  spi.last_byte_rise = 0;
+}
+
+static void sck_changed(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  uint64_t now = avr->cycle;
+  (void)irq;
+  (void)param;
+
+  value = value ? 1 : 0;
+  if (value == (uint32_t)spi.sck) {
+    return;
+  }
+  spi.sck = value;
+  if (value) {
+    // rising edge: sample MOSI
+    if (spi.bit == 0) {
+      spi.out = target_spi_begin(target_in_reset(), now);
+      avr_raise_irq(miso_irq, (spi.out >> 7) & 1);
+      spi.rise_of_byte = now;
+      if (spi.last_byte_rise) {
+        spi.byte_sum += now - spi.last_byte_rise;
+        spi.byte_gaps++;
+      }
+      spi.last_byte_rise = now;
+    } else {
+      spi.period_sum += now - spi.last_rise;
+      spi.periods++;
+    }
+    spi.last_rise = now;
+    spi.in = (spi.in << 1) | ((avr->data[PORTD_ADDR] >> 4) & 1);
+    spi.bit++;
+  } else {
+    // falling edge: next MISO bit or end of byte
+    if (spi.bit == 0) {
+      return;
+    }
+    spi.high_sum += now - spi.last_rise;
+    spi.highs++;
+    if (spi.bit == 8) {
+      target_spi_end(spi.in, now);
+      spi.bit = 0;
+      spi.bytes++;
+    } else {
+      avr_raise_irq(miso_irq, (spi.out >> (7 - spi.bit)) & 1);
+    }
+  }
+}
+
+static void reset_changed(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  (void)irq;
+  (void)param;
+  (void)value;
+  // a new programming session starts byte aligned
+  spi.bit = 0;
+}
+
+/* ---------- UART host ---------- */
+
+static uint8_t tx_queue[4096];
+static unsigned int tx_len = 0, tx_pos = 0;
+static int xon = 1;
+static uint8_t answer[MAX_FRAME + 6];
+static unsigned int answer_len = 0;
+static unsigned long rx_bytes, answer_bytes;
+
+static void uart_out(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  (void)irq;
+  (void)param;
+  if (answer_len < sizeof(answer)) {
+    answer[answer_len++] = value;
+  }
+  answer_bytes++;
+}
+
+static void uart_xon(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  (void)irq;
+  (void)value;
+  (void)param;
+  xon = 1;
+}
+
+static void uart_xoff(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  (void)irq;
+  (void)value;
+  (void)param;
+  xon = 0;
+}
+
+static int answer_complete(void)
+{
+  unsigned int len;
+  if (answer_len < 5) {
+    return 0;
+  }
+  len = (answer[2] << 8) | answer[3];
+  return answer_len >= len + 6;
+}
+
+/* ---------- driver ---------- */
+
+static avr_irq_t *uart_in_irq;
+
+/* one avr_run() step, its cycles go to the group of the function at pc */
+static void step(void)
+{
+  uint32_t pc = avr->pc;
+  uint64_t c = avr->cycle;
+  int state, s;
+
+  if (xon && tx_pos < tx_len) {
+    avr_raise_irq(uart_in_irq, tx_queue[tx_pos++]);
+    rx_bytes++;
+  }
+  state = avr_run(avr);
+  s = pc_symbol(pc);
+  if (s < 0) {
+    group_cycles[G_OTHER] += avr->cycle - c;
+  } else {
+    group_cycles[sym[s].group] += avr->cycle - c;
+    if (sym[s].known >= 0) {
+      known_cycles[sym[s].known] += avr->cycle - c;
+    }
+  }
+  if (state == cpu_Done || state == cpu_Crashed) {
+    fprintf(stderr, "simavr_bench: cpu stopped (state %d) at pc 0x%04x\n", state, pc);
+    exit(1);
+  }
+}
+
+/* run until done() returns 1, fail after limit cycles */
+static void run_until(int (*done)(void), uint64_t limit)
+{
+  uint64_t end = avr->cycle + limit;
+
+  while (!done() && avr->cycle < end) {
+    step();
+  }
+  if (!done()) {
+    fprintf(stderr, "simavr_bench: timeout\n");
+    exit(1);
+  }
+}
+
+/* run for a fixed number of cycles */
+static void run_for(uint64_t cycles)
+{
+  uint64_t end = avr->cycle + cycles;
+
+  while (avr->cycle < end) {
+    step();
+  }
+}
+
+static uint8_t seqnum = 0;
+
+/* send one command and run until its answer is complete, returns the status byte */
+static uint8_t command(const uint8_t *body, unsigned int len)
+{
+  uint8_t hdr[5] = { 0x1B, ++seqnum, len >> 8, len & 0xFF, 0x0E };
+  uint8_t ck = 0;
+  unsigned int i;
+
+  tx_len = tx_pos = 0;
+  for (i = 0; i < 5; i++) {
+    tx_queue[tx_len++] = hdr[i];
+    ck ^= hdr[i];
+  }
+  for (i = 0; i < len; i++) {
+    tx_queue[tx_len++] = body[i];
+    ck ^= body[i];
+  }
+  tx_queue[tx_len++] = ck;
+  answer_len = 0;
+  run_until(answer_complete, 10ULL * F_CPU);
+  return answer[6];
+}
+
+#define CMD(...) do { \
+    static const uint8_t b_[] = { __VA_ARGS__ }; \
+    command(b_, sizeof(b_)); \
+  } while (0)
+
+static void load_address(uint32_t a)
+{
+  uint8_t b[5] = { 0x06, a >> 24, a >> 16, a >> 8, a };
+  command(b, sizeof(b));
+}
+
+static void set_sck(uint8_t d)
+{
+  uint8_t b[3] = { 0x02, 0x98, d };
+  command(b, sizeof(b));
+}
+
+/* ---------- measurements ---------- */
+
+static uint64_t t_start;
+static unsigned long rx_start, answer_start;
+static int first_result = 1;
+
+static void measure_begin(void)
+{
+  memset(group_cycles, 0, sizeof(group_cycles));
+  spi_stats_reset();
+  t_start = avr->cycle;
+  rx_start = rx_bytes;
+  answer_start = answer_bytes;
+}
+
+static void result_begin(const char *name)
+{
+  printf("%s {\"bench\": \"%s\"", first_result ? "[\n" : ",\n", name);
+  first_result = 0;
+}
+
+static void result_common(unsigned long payload)
+{
+  uint64_t cycles = avr->cycle - t_start;
+  double seconds = (double)cycles / F_CPU;
+  int g;
+
+  printf(", \"cycles\": %llu, \"seconds\": %.6f", (unsigned long long)cycles, seconds);
+  if (payload) {
+    printf(", \"payload_bytes\": %lu, \"kbytes_per_s\": %.3f", payload, payload / seconds / 1024);
+    printf(", \"programcmd_cycles_per_byte\": %.1f", (double)group_cycles[G_PROGRAMCMD] / payload);
+  }
+  if (rx_bytes > rx_start) {
+    printf(", \"parser_cycles_per_byte\": %.1f",
+           (double)(group_cycles[G_PARSER] + group_cycles[G_RX_ISR]) / (rx_bytes - rx_start));
+  }
+  if (answer_bytes > answer_start) {
+    printf(", \"answer_cycles_per_byte\": %.1f",
+           (double)group_cycles[G_ANSWER] / (answer_bytes - answer_start));
+  }
+  if (spi.bytes) {
+    printf(", \"spi_bytes\": %lu, \"spi_cycles_per_byte\": %.1f", spi.bytes,
+           spi.byte_gaps ? (double)spi.byte_sum / spi.byte_gaps : 0.0);
+    printf(", \"spi_kernel_cycles_per_byte\": %.1f", (double)group_cycles[G_SPI] / spi.bytes);
+  }
+  if (spi.periods) {
+    double period = (double)spi.period_sum / spi.periods;
+    printf(", \"sck_hz\": %.0f, \"sck_duty\": %.3f", F_CPU / period,
+           spi.highs ? ((double)spi.high_sum / spi.highs) / period : 0.0);
+  }
+  printf(", \"cycles_by_group\": {");
+  for (g = 0; g < G_COUNT; g++) {
+    printf("%s\"%s\": %llu", g ? ", " : "", group_name[g], (unsigned long long)group_cycles[g]);
+  }
+  printf("}}");
+}
+
+static void program_pages(unsigned int pages, unsigned int size)
+{
+  uint8_t b[10 + 256];
+  unsigned int p, i;
+
+  for (p = 0; p < pages; p++) {
+    load_address(p * size / 2);
+    b[0] = 0x13;
+    b[1] = size >> 8;
+    b[2] = size & 0xFF;
+    b[3] = 0xC1;          // page mode, RDY/BSY polling, write page
+    b[4] = 6;
+    b[5] = 0x40;
+    b[6] = 0x4C;
+    b[7] = 0x20;
+    b[8] = 0xFF;
+    b[9] = 0xFF;
+    for (i = 0; i < size; i++) {
+      b[10 + i] = (i * 7 + p) & 0xFF;
+    }
+    command(b, 10 + size);
+  }
+}
+
+static void read_pages(unsigned int pages, unsigned int size)
+{
+  uint8_t b[4] = { 0x14, size >> 8, size & 0xFF, 0x20 };
+  unsigned int p;
+
+  for (p = 0; p < pages; p++) {
+    load_address(p * size / 2);
+    command(b, sizeof(b));
+  }
+}
+
+int main(int argc, char **argv)
+{
+  static const uint8_t sck_settings[] = { 0, 1, 2, 3, 10 };
+  elf_firmware_t f;
+  uint32_t flags = 0;
+  unsigned int i;
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s main.out main.sym\n", argv[0]);
+    return 2;
+  }
+  memset(&f, 0, sizeof(f));
+  if (elf_read_firmware(argv[1], &f)) {
+    fprintf(stderr, "simavr_bench: can not read %s\n", argv[1]);
+    return 1;
+  }
+  strcpy(f.mmcu, "atmega88");
+  f.frequency = F_CPU;
+  load_symbols(argv[2]);
+
+  avr = avr_make_mcu_by_name(f.mmcu);
+  if (!avr) {
+    fprintf(stderr, "simavr_bench: no atmega88 support in simavr\n");
+    return 1;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &f);
+
+  // UART: no stdio echo, talk to the script
+  avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+  flags &= ~AVR_UART_FLAG_STDIO;
+  avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+  uart_in_irq = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uart_out, NULL);
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XON), uart_xon, NULL);
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XOFF), uart_xoff, NULL);
+
+  // SPI slave on port D, reset on PB0
+  miso_irq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), IOPORT_IRQ_PIN3);
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), IOPORT_IRQ_PIN2), sck_changed, NULL);
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN0), reset_changed, NULL);
+  target_init();
+
+  // power up LED sequence
+  run_for(3ULL * F_CPU / 2);
+  CMD(0x01);                                                    // CMD_SIGN_ON
+
+  // SCK generation and SPI byte cost at each setting
+  CMD(0x10, 200, 100, 25, 32, 0, 0x53, 3, 0xAC, 0x53, 0x00, 0x00); // enter progmode
+  for (i = 0; i < sizeof(sck_settings); i++) {
+    char name[32];
+    set_sck(sck_settings[i]);
+    load_address(0);
+    measure_begin();
+    CMD(0x14, 0x00, 0x40, 0x20);                                // read 64 bytes
+    sprintf(name, "spi_sck_%u", sck_settings[i]);
+    result_begin(name);
+    printf(", \"sck_duration\": %u", sck_settings[i]);
+    result_common(64);
+  }
+
+  // end to end flash write and read at the fastest setting
+  set_sck(0);
+  CMD(0x12, 9, 1, 0xAC, 0x80, 0x00, 0x00);                      // chip erase
+  measure_begin();
+  program_pages(16, 128);
+  result_begin("flash_write");
+  result_common(16 * 128);
+
+  measure_begin();
+  read_pages(16, 256);
+  result_begin("flash_read");
+  result_common(16 * 256);
+
+  // whole device (16K words), the streaming read path
+  measure_begin();
+  read_pages(FLASH_READ_PAGES, 256);
+  result_begin("flash_read_device");
+  result_common(FLASH_READ_PAGES * 256UL);
+
+  // protocol only: parser and answer cost without SPI
+  measure_begin();
+  for (i = 0; i < 50; i++) {
+    CMD(0x03, 0x98);                                            // get SCK duration
+  }
+  result_begin("get_parameter");
+  result_common(0);
+
+  CMD(0x11, 1, 1);                                              // leave progmode
+  check_known_cycles();
+  printf("\n]\n");
+  target_report();
+  return 0;
+}
@@ -0,0 +1,229 @@
+/* vim: set sw=2 ts=2 si et: */
+/*********************************************
+* Host build: simulated AVR target (ATmega328P) speaking the
+* serial programming instruction set.
+*
+* The target is byte synchronous: every 4 bytes form one instruction.
+* Byte 2 and 3 echo the previous byte, byte 4 returns read data.
+* target_spi() works on whole bytes (host build), target_spi_begin()
+* and target_spi_end() let a bit level SPI model use it (simavr).
+* Writes keep the target busy for the datasheet times, instructions
+* other than "Poll RDY/BSY" during that time are ignored and counted,
+* so a firmware that does not wait long enough shows up in the report.
+*
+* Author: Clancy Palmer
+* License: GPL
+* Copyright: GPL
+**********************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+
+#define FLASH_WORDS     16384
+#define PAGE_WORDS      64
+#define EEPROM_SIZE     1024
+#define EEPROM_PAGE     4
+
+// write times in microseconds (ATmega328P datasheet, table 28-18),
+// AVRUSB_SIM_EEPROM_US overrides the EEPROM one (other parts)
+#define T_WD_FLASH      4500
+#define T_WD_EEPROM     3600
+#define T_WD_ERASE      9000
+#define T_WD_FUSE       4500
+
+#define US(t)           ((uint64_t)(t) * (F_CPU / 1000000UL))
+
+static uint16_t flash[FLASH_WORDS];
+static uint16_t page[PAGE_WORDS];
+static uint8_t eeprom[EEPROM_SIZE];
+static uint8_t eeprom_page[EEPROM_PAGE];
+static uint8_t eeprom_loaded;   // bit per page buffer byte, only those are written
+static const uint8_t signature[3] = { 0x1E, 0x95, 0x0F };
+static uint8_t fuse_low = 0x62, fuse_high = 0xD9, fuse_ext = 0xFF, lock = 0xFF;
+static uint8_t osccal = 0x9A;
+static uint8_t ext_addr = 0;
+
+static uint8_t cmd[4];
+static uint8_t pos = 0;
+static int prog_enabled = 0;
+static int selected = 0;
+static uint64_t busy_until = 0;
+static unsigned long t_wd_eeprom = T_WD_EEPROM;
+
+// statistics
+static unsigned long n_instr, n_busy_ignored, n_page_writes, n_eeprom_writes, n_polls;
+
+void target_init(void)
+{
+  const char *t = getenv("AVRUSB_SIM_EEPROM_US");
+
+  memset(flash, 0xFF, sizeof(flash));
+  memset(page, 0xFF, sizeof(page));
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  memset(eeprom_page, 0xFF, sizeof(eeprom_page));
+  eeprom_loaded = 0;
+  if (t && atol(t) > 0) {
+    t_wd_eeprom = (unsigned long)atol(t);
+  }
+}
+
+static uint8_t target_read(uint64_t now)
+{
+  uint32_t a = ((uint32_t)ext_addr << 16) | (cmd[1] << 8) | cmd[2];
+
+  if (cmd[0] == 0xF0) {
+    n_polls++;
+    return now < busy_until;
+  }
+  if (now < busy_until) {
+    return 0xFF;
+  }
+  switch (cmd[0]) {
+    case 0x20: // read program memory, low byte
+      return flash[a % FLASH_WORDS] & 0xFF;
+    case 0x28: // read program memory, high byte
+      return flash[a % FLASH_WORDS] >> 8;
+    case 0xA0: // read EEPROM
+      return eeprom[((cmd[1] << 8) | cmd[2]) % EEPROM_SIZE];
+    case 0x30: // read signature byte
+      return (cmd[2] & 3) < 3 ? signature[cmd[2] & 3] : 0xFF;
+    case 0x38: // read calibration byte
+      return osccal;
+    case 0x50:
+      return cmd[1] == 0x08 ? fuse_ext : fuse_low;
+    case 0x58:
+      return cmd[1] == 0x08 ? fuse_high : lock;
+  }
+  return cmd[2];
+}
+
+static void target_execute(uint64_t now)
+{
+  uint16_t a = (cmd[1] << 8) | cmd[2];
+
+  n_instr++;
+  if (cmd[0] == 0xAC && cmd[1] == 0x53) {
+    prog_enabled = 1;
+    return;
+  }
+  if (!prog_enabled || cmd[0] == 0xF0) {
+    return;
+  }
+  if (now < busy_until) {
+    n_busy_ignored++;
+    return;
+  }
+  switch (cmd[0]) {
+    case 0x4D: // load extended address
+      ext_addr = cmd[2];
+      break;
+    case 0x40: // load program memory page, low byte
+      page[cmd[2] % PAGE_WORDS] = (page[cmd[2] % PAGE_WORDS] & 0xFF00) | cmd[3];
+      break;
+    case 0x48: // load program memory page, high byte
+      page[cmd[2] % PAGE_WORDS] = (page[cmd[2] % PAGE_WORDS] & 0x00FF) | (cmd[3] << 8);
+      break;
+    case 0x4C: { // write program memory page
+      uint32_t base = ((((uint32_t)ext_addr << 16) | a) % FLASH_WORDS) & ~(PAGE_WORDS - 1);
+      int i;
+      for (i = 0; i < PAGE_WORDS; i++) {
+        flash[base + i] &= page[i]; // flash can only clear bits
+      }
+      memset(page, 0xFF, sizeof(page));
+      busy_until = now + US(T_WD_FLASH);
+      n_page_writes++;
+      break;
+    }
+    case 0xC0: // write EEPROM byte
+      eeprom[a % EEPROM_SIZE] = cmd[3];
+      busy_until = now + US(t_wd_eeprom);
+      n_eeprom_writes++;
+      break;
+    case 0xC1: // load EEPROM page
+      eeprom_page[cmd[2] % EEPROM_PAGE] = cmd[3];
+      eeprom_loaded |= 1 << (cmd[2] % EEPROM_PAGE);
+      break;
+    case 0xC2: { // write EEPROM page
+      int i;
+      for (i = 0; i < EEPROM_PAGE; i++) {
+        if (eeprom_loaded & (1 << i)) {
+          eeprom[((a & ~(EEPROM_PAGE - 1)) + i) % EEPROM_SIZE] = eeprom_page[i];
+        }
+      }
+      memset(eeprom_page, 0xFF, sizeof(eeprom_page));
+      eeprom_loaded = 0;
+      busy_until = now + US(t_wd_eeprom);
+      n_eeprom_writes++;
+      break;
+    }
+    case 0xAC:
+      if (cmd[1] == 0x80) { // chip erase
+        memset(flash, 0xFF, sizeof(flash));
+        memset(eeprom, 0xFF, sizeof(eeprom));
+        lock = 0xFF;
+        busy_until = now + US(T_WD_ERASE);
+      } else if (cmd[1] == 0xA0) {
+        fuse_low = cmd[3];
+        busy_until = now + US(T_WD_FUSE);
+      } else if (cmd[1] == 0xA8) {
+        fuse_high = cmd[3];
+        busy_until = now + US(T_WD_FUSE);
+      } else if (cmd[1] == 0xA4) {
+        fuse_ext = cmd[3];
+        busy_until = now + US(T_WD_FUSE);
+      } else if (cmd[1] == 0xE0) {
+        lock = cmd[3];
+        busy_until = now + US(T_WD_FUSE);
+      }
+      break;
+  }
+}
+
+/* start of a byte, returns the byte the target will shift out */
+uint8_t target_spi_begin(int in_reset, uint64_t now)
+{
+  if (!in_reset) {
+    // not in programming mode, MISO is not driven
+    pos = 0;
+    prog_enabled = 0;
+    selected = 0;
+    return 0xFF;
+  }
+  selected = 1;
+  if (pos == 0) {
+    return 0x00;
+  } else if (pos < 3) {
+    return cmd[pos - 1];
+  }
+  return target_read(now);
+}
+
+/* end of a byte, in is the byte shifted in from the programmer */
+void target_spi_end(uint8_t in, uint64_t now)
+{
+  if (!selected) {
+    return;
+  }
+  cmd[pos++] = in;
+  if (pos == 4) {
+    target_execute(now);
+    pos = 0;
+  }
+}
+
+/* shift one byte, returns the byte clocked out by the target */
+uint8_t target_spi(uint8_t in, int in_reset, uint64_t now)
+{
+  uint8_t out = target_spi_begin(in_reset, now);
+  target_spi_end(in, now);
+  return out;
+}
+
+void target_report(void)
+{
+  fprintf(stderr, "target: %lu instructions, %lu page writes, %lu eeprom writes, "
+          "%lu busy polls, %lu ignored while busy\n",
+          n_instr, n_page_writes, n_eeprom_writes, n_polls, n_busy_ignored);
+}
@@ -5,6 +5,8 @@
 * gives more flexibility. The ATMega88 is at 18.432MHz is fast
 * enough to do this. The C-code here is highly optimized
 * for speed.
+* Boards wired to the hardware SPI pins (SPI_HW) use the
+* SPI peripheral for the fast SCK settings.
 *
 * Modified by: Clancy Palmer
 * Original Author: Guido Socher
@@ -13,28 +15,54 @@
 **********************************************/
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
 #include <util/delay.h>
 #include "timeout.h"
 #include "spi.h"
+#include "hal.h"
 
-static unsigned char sck_dur = 1;
-static unsigned char d_sck_dur = 9;
+// SCK timing, see spi_set_sck_duration()
+static unsigned char sck_dur = 1;      // STK500 setting closest to the applied rate
+static unsigned int sck_half = 20;     // SCK half period in CPU cycles
+static unsigned int sck_loops = 4;     // delay loop count of spi_kernel_delay(), 0 = unrolled kernel
+static unsigned char sck_fast = 0;     // PARAM_EXT_SCK_FAST
+static unsigned char d_sck_dur = 7;    // _delay_loop_1() count of at least one half period
+#ifdef SPI_HW
+static unsigned char hw_spcr = 0;     // SPCR value, 0 = bit-bang
+static unsigned char hw_spsr = 0;     // SPI2X setting
+static unsigned char spi_enabled = 0; // between spi_init() and spi_disable()
+#endif
+
+// Transfer statistics. spi_xmit() only counts bytes in spi_count_lo/hi,
+// spi_stats_fold() adds them to the totals with the time they took at the
+// current rate (16 half periods each) before the rate changes.
+#define SPI_TIME_DIV (F_CPU / 1000 / TIMER_TICKS_MS / 16)  // 16 cycle units per tick
+static unsigned char spi_count_lo = 0;
+static unsigned int spi_count_hi = 0;
+static unsigned long spi_bytes = 0;
+static unsigned long spi_time = 0;     // in 1/TIMER_TICKS_MS ms
+static unsigned char spi_time_rest = 0; // 16 cycle units, < SPI_TIME_DIV
 
 void spi_disable(void)
 {
+#ifdef SPI_HW
+  spi_enabled = 0;
+  SPCR = 0;               // SPI peripheral off, pins back to port control
+#endif
   // Just to be sure:
-  DDRD |= (1 << DDD2); // SCK is output
+  SPI_DDR |= (1 << SCK_BIT); // SCK is output
   SCK_LOW;
 
   RST_HIGH;               // +5V, reset off
 
   // All other pins as input:
-  DDRD &= ~(1 << DDD3);   // MISO is input
-  PORTD &= ~(1 << PIND3); // Pullup off
-  DDRD &= ~(1 << DDD2);   // SCK as input
-  PORTD &= ~(1 << PIND2); // Pullup off
-  DDRD &= ~(1 << DDD4);   // MOSI as input
-  PORTD &= ~(1 << PIND4); // Pullup off
+  SPI_DDR &= ~(1 << MISO_BIT);  // MISO is input
+  SPI_PORT &= ~(1 << MISO_BIT); // Pullup off
+  SPI_DDR &= ~(1 << SCK_BIT);   // SCK as input
+  SPI_PORT &= ~(1 << SCK_BIT);  // Pullup off
+  SPI_DDR &= ~(1 << MOSI_BIT);  // MOSI as input
+  SPI_PORT &= ~(1 << MOSI_BIT); // Pullup off
 
   delay_ms(20);
 
@@ -52,20 +80,23 @@ void spi_init(void)
 {
   // The connections for the sotware only SPI are as follows:
   // Reset = PB0
-  // MOSI  = PD4
-  // MISO  = PD3
-  // SCK   = PD2
+  // MOSI  = PD4 (PB3 with SPI_HW)
+  // MISO  = PD3 (PB4 with SPI_HW)
+  // SCK   = PD2 (PB5 with SPI_HW)
 
   // Configure target reset pin
   DDRB |= (1 << DDB0);    // Reset pin as output
   RST_HIGH;               // +5V, reset off
 
   // Configure SPI pins
-  DDRD &= ~(1 << DDD3);   // MISO is input
-  DDRD |= (1 << DDD4);    // MOSI is output
+  SPI_DDR &= ~(1 << MISO_BIT); // MISO is input
+  SPI_DDR |= (1 << MOSI_BIT);  // MOSI is output
   MOSI_LOW;               // MOSI low in case target uses as output
-  DDRD |= (1 << DDD2);    // SCK is output
+  SPI_DDR |= (1 << SCK_BIT);   // SCK is output
   SCK_LOW;                // SCK low in case target uses as output
+#ifdef SPI_HW
+  DDRB |= (1 << DDB2);    // SS must be an output in master mode (it is CLKOUT anyway)
+#endif
   
   // Enable SN74ACH125N outputs
   DDRD |= (1 << DDD5);    // PD5 is output
@@ -75,59 +106,253 @@ void spi_init(void)
   RST_LOW;                // Reset = low, stay active
   delay_ms(20);           // stab delay
   spi_reset_pulse();
+#ifdef SPI_HW
+  spi_enabled = 1;
+  SPSR = hw_spsr;
+  SPCR = hw_spcr;
+#endif
+}
+
+#ifndef HOST_BUILD
+// Fully unrolled software SPI kernel, MSB first, SPI mode 0.
+// Every instruction between the port writes is a single cycle one and
+// the sbic/ori pair takes 2 cycles either way, so SCK is high and low for
+// the same time whatever the data and MISO. MOSI changes with the falling
+// edge of SCK and MISO is sampled right after the rising edge.
+// Counted from the AVR instruction set timings, not measured: 8 + 2 * k
+// cycles per bit (4 + k per phase), at 18.432MHz k = 0 -> 2.304MHz,
+// 1 -> 1.843MHz. A byte adds about 8 cycles of setup plus the call.
+// The kernel writes the whole SPI port, nothing else may change it
+// from an interrupt. Interrupts can stretch a phase but never shorten it.
+// The transceive kernel is also used for transmit only, skipping the
+// MISO sample would not make a bit shorter.
+#define SPI_KERNEL(name, k) \
+static unsigned char name(unsigned char data) \
+{ \
+  unsigned char lo, hi, rx; \
+  asm volatile ( \
+    "in   %[lo], %[port]"             "\n\t" \
+    "andi %[lo], %[mask]"             "\n\t" \
+    "mov  %[hi], %[lo]"               "\n\t" \
+    "ori  %[hi], %[sck]"              "\n\t" \
+    "clr  %[rx]"                      "\n\t" \
+    "bst  %[tx], 7"                   "\n\t" \
+    "bld  %[lo], %[mosi]"             "\n\t" \
+    ".irp b, 7, 6, 5, 4, 3, 2, 1, 0"  "\n\t" \
+    "out  %[port], %[lo]"             "\n\t" /* SCK low, MOSI = bit b */ \
+    "bld  %[hi], %[mosi]"             "\n\t" \
+    "bst  %[tx], (\\b + 7) & 7"       "\n\t" /* next bit */ \
+    "nop"                             "\n\t" \
+    ".rept %[dly]\n\tnop\n\t.endr"    "\n\t" \
+    "out  %[port], %[hi]"             "\n\t" /* SCK high */ \
+    "sbic %[pin], %[miso]"            "\n\t" \
+    "ori  %[rx], 1 << \\b"            "\n\t" \
+    "bld  %[lo], %[mosi]"             "\n\t" \
+    ".rept %[dly]\n\tnop\n\t.endr"    "\n\t" \
+    ".endr"                           "\n\t" \
+    "out  %[port], %[lo]"             "\n\t" /* SCK low */ \
+    : [lo] "=&d" (lo), [hi] "=&d" (hi), [rx] "=&d" (rx) \
+    : [tx] "r" (data), \
+      [port] "I" (_SFR_IO_ADDR(SPI_PORT)), [pin] "I" (_SFR_IO_ADDR(SPI_PIN)), \
+      [mask] "M" ((unsigned char)~((1 << SCK_BIT) | (1 << MOSI_BIT))), \
+      [sck] "M" (1 << SCK_BIT), [mosi] "I" (MOSI_BIT), [miso] "I" (MISO_BIT), \
+      [dly] "n" (k) \
+  ); \
+  return rx; \
+}
+
+// 1.8432MHz, the fastest STK500 setting
+SPI_KERNEL(spi_kernel_1843k, 1)
+// 2.304MHz, sck_dur 0 with PARAM_EXT_SCK_FAST
+SPI_KERNEL(spi_kernel_2304k, 0)
+
+// Same bit schedule as SPI_KERNEL() with a run time delay loop in both
+// phases: SCK is high and low for 4 + 4 * loops cycles each (loops >= 1).
+static unsigned char spi_kernel_delay(unsigned char data, unsigned int loops)
+{
+  unsigned char lo, hi, rx;
+  unsigned int cnt;
+  asm volatile (
+    "in   %[lo], %[port]"             "\n\t"
+    "andi %[lo], %[mask]"             "\n\t"
+    "mov  %[hi], %[lo]"               "\n\t"
+    "ori  %[hi], %[sck]"              "\n\t"
+    "clr  %[rx]"                      "\n\t"
+    "bst  %[tx], 7"                   "\n\t"
+    "bld  %[lo], %[mosi]"             "\n\t"
+    ".irp b, 7, 6, 5, 4, 3, 2, 1, 0"  "\n\t"
+    "out  %[port], %[lo]"             "\n\t" /* SCK low, MOSI = bit b */
+    "bld  %[hi], %[mosi]"             "\n\t"
+    "bst  %[tx], (\\b + 7) & 7"       "\n\t" /* next bit */
+    "nop"                             "\n\t"
+    "movw %[cnt], %[loops]"           "\n\t"
+    "1: sbiw %[cnt], 1"               "\n\t" /* 4 * loops - 1 cycles */
+    "brne 1b"                         "\n\t"
+    "out  %[port], %[hi]"             "\n\t" /* SCK high */
+    "sbic %[pin], %[miso]"            "\n\t"
+    "ori  %[rx], 1 << \\b"            "\n\t"
+    "bld  %[lo], %[mosi]"             "\n\t"
+    "movw %[cnt], %[loops]"           "\n\t"
+    "1: sbiw %[cnt], 1"               "\n\t"
+    "brne 1b"                         "\n\t"
+    ".endr"                           "\n\t"
+    "out  %[port], %[lo]"             "\n\t" /* SCK low */
+    : [lo] "=&d" (lo), [hi] "=&d" (hi), [rx] "=&d" (rx), [cnt] "=&w" (cnt)
+    : [tx] "r" (data), [loops] "r" (loops),
+      [port] "I" (_SFR_IO_ADDR(SPI_PORT)), [pin] "I" (_SFR_IO_ADDR(SPI_PIN)),
+      [mask] "M" ((unsigned char)~((1 << SCK_BIT) | (1 << MOSI_BIT))),
+      [sck] "M" (1 << SCK_BIT), [mosi] "I" (MOSI_BIT), [miso] "I" (MISO_BIT)
+  );
+  return rx;
+}
+#endif
+
+// PARAM_SCK_DURATION is interpreted like a real STK500 does it (the
+// period is given in cycles of its 7.3728MHz crystal), this is also what
+// avrdude -B and AVR Studio compute:
+// sck_dur       STK500 period     sck-freq
+// 0              4                1.8432MHz
+// 1              16               460.8kHz
+// 2              64               115.2kHz
+// 3              128              57.6kHz
+// 4..255         24 * dur + 20    63.6kHz..1.2kHz
+//
+// The rates the firmware produces are calculated from the kernel cycle
+// counts (see SPI_KERNEL()), they were not measured on hardware or in a
+// cycle accurate simulation ('make bench' reports sck_hz per setting).
+// At 18.432MHz the bit-bang kernels can do any SCK half period of
+// 5 cycles (1.8432MHz) or 4 + 4 * n cycles (n = 1..65535, 1.152MHz and
+// below). The requested rate is rounded to the nearest achievable one that
+// is not faster: durations 0..3 are exact, 4..255 are within 3 cycles of
+// 30 * dur + 25 (about 2% at most).
+// SPI_HW builds use the SPI peripheral (half period 1..64 cycles) with the
+// nearest prescaler that is not faster than the request, also where the
+// bit-bang rate would be closer (duration 0: F_CPU / 16, 1.152MHz). Only
+// requests below F_CPU / 128 (dur 2 and up) are bit-banged. Throughput
+// is bound by the UART at these rates.
+// With PARAM_EXT_SCK_FAST set, sck_dur 0 runs at 2.304MHz (half period 4
+// cycles, F_CPU / 8 with SPI_HW). Each SCK phase is then 217ns, which
+// needs a target clock of at least 14MHz. F_CPU / 4 would need 28MHz and
+// is never used.
+#define STK500_XTAL_DIV   3200UL        // 7.3728MHz = 3200 * 2304
+#define STK500_XTAL_MUL   2304UL
+#define CPU_CYCLES_MUL    (F_CPU / STK500_XTAL_DIV)
+
+// SCK period in STK500 crystal cycles
+static unsigned int spi_stk500_period(unsigned char dur)
+{
+  static const unsigned char period[4] PROGMEM = { 4, 16, 64, 128 };
+  if (dur < 4) {
+    return pgm_read_byte(&period[dur]);
+  }
+  return 24 * (unsigned int)dur + 20;
+}
+
+static void spi_stats_fold(void)
+{
+  unsigned long n = ((unsigned long)spi_count_hi << 8) | spi_count_lo;
+  unsigned long c;
+
+  spi_count_lo = 0;
+  spi_count_hi = 0;
+  spi_bytes += n;
+  c = n * sck_half + spi_time_rest;
+  spi_time += c / SPI_TIME_DIV;
+  spi_time_rest = c % SPI_TIME_DIV;
+}
+
+/* bytes transferred and the time SCK was clocking them */
+unsigned long spi_stats_bytes(void)
+{
+  spi_stats_fold();
+  return spi_bytes;
+}
+
+unsigned long spi_stats_time(void)
+{
+  spi_stats_fold();
+  return spi_time;
+}
+
+void spi_stats_clear(void)
+{
+  spi_stats_fold();
+  spi_bytes = 0;
+  spi_time = 0;
+  spi_time_rest = 0;
 }
 
-// the mapping between SCK freq and SCK_DURATION is for avrisp as follows:
-// this table is for 14.7 MHz:
-// sck_dur       sck-freq   d_sck_dur
-// 0              921kHz     1
-//                520kHz     2
-//                370kHz     4
-//                280kHz     6
-// 1              230kHz     7
-//                100kHz     22
-// 2              57kHz      50
-// 3              28kHz      80
-// 4              27kHz      90
-// 5              26kHz      100
-// 7              20kHz      120
-// 8              18kHz      140
-// 10             15kHz      160
-// 15             10kHz      240
-// 19             9 kHz      254
-// 25             6 kHz
-// 50             3 kHz
-// 100            1.5kHz
 unsigned char  spi_set_sck_duration(unsigned char dur)
 {
-  if (dur >= 10) {
-    // 10Khz
-    sck_dur = 15;
-    d_sck_dur = 253;
-  } else if (dur >= 7) {
-    // 20Khz
-    sck_dur = 7;
-    d_sck_dur = 150;
-  } else if (dur >= 3) {
-    // 28KHz
-    sck_dur = 3;
-    d_sck_dur = 100;
-  } else if (dur >= 2) {
-    // 57KHz
-    sck_dur = 2;
-    d_sck_dur = 60;
-  } else if (dur >= 1) {
-    // 230KHz
-    sck_dur = 1;
-    d_sck_dur = 9;
-  } else if (dur < 1 ) {
-    // 900KHz
-    sck_dur = 0;
-    d_sck_dur = 2;
+  unsigned long c;
+  unsigned int h;
+
+  spi_stats_fold();
+  // minimum half period in CPU cycles, rounded up so we never run faster
+  c = (unsigned long)spi_stk500_period(dur) * CPU_CYCLES_MUL;
+  h = (c + 2 * STK500_XTAL_MUL - 1) / (2 * STK500_XTAL_MUL);
+  if (dur == 0 && sck_fast) {
+    h = 4;
+  }
+  if (h <= 5) {
+    sck_half = h;
+    sck_loops = 0;
   } else {
-    // we should never come here
+    sck_loops = (h - 4 + 3) / 4;
+    sck_half = 4 + 4 * sck_loops;
+  }
+#ifdef SPI_HW
+  // nearest prescaler F_CPU / (2 * hh) not exceeding the request, the
+  // peripheral takes over from bit-banging down to F_CPU / 128
+  hw_spcr = 0;
+  hw_spsr = 0;
+  {
+    // SPR1, SPR0, SPI2X for F_CPU / 2, 4, 8, 16, 32, 64, 128
+    static const unsigned char prescaler[7] PROGMEM = {
+      0x01, 0x00, 0x03, 0x02, 0x05, 0x04, 0x06
+    };
+    unsigned char i, ps;
+    unsigned int hh = 1;
+    for (i = 0; i < 7; i++) {
+      if (hh >= h) {
+        ps = pgm_read_byte(&prescaler[i]);
+        hw_spcr = (1 << SPE) | (1 << MSTR) | ((ps >> 1) & 0x03);
+        hw_spsr = ps & 0x01;
+        sck_half = hh;
+        break;
+      }
+      hh <<= 1;
+    }
+  }
+  if (spi_enabled) {
+    SPSR = hw_spsr;
+    SPCR = hw_spcr;
+  }
+#endif
+  // delay used for the reset and sck pulses
+  h = sck_half / 3 + 1;
+  d_sck_dur = (h > 255) ? 255 : h;
+
+  // report the STK500 setting closest to the applied rate
+  c = ((unsigned long)sck_half * 2 * STK500_XTAL_MUL + CPU_CYCLES_MUL / 2) / CPU_CYCLES_MUL;
+  if (c < 10) {
+    sck_dur = 0;
+  } else if (c < 40) {
     sck_dur = 1;
-    d_sck_dur = 9;
+  } else if (c < 96) {
+    sck_dur = 2;
+  } else {
+    // 3 (period 128) sits between 4 and 5 (116 and 140)
+    h = (c < 116) ? 4 : (c - 20 + 12) / 24;
+    if (h > 255) {
+      h = 255;
+    }
+    sck_dur = h;
+    h = 24 * h + 20;
+    h = (h > c) ? h - c : c - h;
+    if ((c > 128 ? c - 128 : 128 - c) < h) {
+      sck_dur = 3;
+    }
   }
 
   return (sck_dur);
@@ -138,8 +363,26 @@ unsigned char spi_get_sck_duration(void)
   return (sck_dur);
 }
 
+// PARAM_EXT_SCK_FAST, takes effect at once if sck_dur 0 is applied
+void spi_set_sck_fast(unsigned char on)
+{
+  sck_fast = on;
+  if (sck_dur == 0) {
+    spi_set_sck_duration(0);
+  }
+}
+
+unsigned char spi_get_sck_fast(void)
+{
+  return (sck_fast);
+}
+
 void spi_sck_pulse(void)
 {
+#ifdef SPI_HW
+  // the SPI peripheral owns SCK while enabled
+  SPCR = 0;
+#endif
   SCK_LOW;
   SCK_DELAY;
   SCK_DELAY;
@@ -147,6 +390,9 @@ void spi_sck_pulse(void)
   SCK_DELAY;
   SCK_DELAY;
   SCK_LOW;
+#ifdef SPI_HW
+  SPCR = hw_spcr;
+#endif
 }
 
 void spi_reset_pulse(void)
@@ -166,47 +412,43 @@ void spi_reset_pulse(void)
   delay_ms(20); // min stab delay
 }
 
-// Send 8 bits, no receive
-unsigned char spi_xmit(unsigned char data, unsigned char read)
+// Send 8 bits, return received byte
+static unsigned char spi_xmit(unsigned char data)
 {
-  unsigned char i = 128;
-  unsigned char rval = 0;
+  if (++spi_count_lo == 0) {
+    spi_count_hi++;
+  }
+#ifdef SPI_HW
+  if (hw_spcr) {
+    // hardware spi
+    SPDR = data;
+    while (!(SPSR & (1 << SPIF)));
+    return SPDR;
+  }
+#endif
   // software spi
-  while (i != 0) {
-    // Transmit a 1 or 0
-    if (data & i) {
-      MOSI_HIGH;
-    } else {
-      MOSI_LOW;
+#ifdef HOST_BUILD
+  return hal_spi_xfer(data, sck_half);
+#else
+  if (sck_loops == 0) {
+    if (sck_half == 4) {
+      return spi_kernel_2304k(data);
     }
-    SCK_DELAY;
-
-    if (read) {
-      if (MISO_READ) {
-        rval |= i;
-      }
-    } else {
-      _delay_loop_1(1); // make pulse len equal to read case
-    }
-
-    SCK_HIGH;
-    SCK_DELAY;
-    _delay_loop_1(3);// make low and high pulse equaly long:
-    SCK_LOW;
-    i = i >> 1;
+    return spi_kernel_1843k(data);
   }
-
-  return rval;
+  return spi_kernel_delay(data, sck_loops);
+#endif
 }
 
+// Send 8 bits, no receive
 void spi_mastertransmit_nr(unsigned char data)
 {
-  spi_xmit(data, 0);
+  spi_xmit(data);
 }
 // Send 8 bits, return received byte
 unsigned char spi_mastertransmit(unsigned char data)
 {
-  return spi_xmit(data, 1);
+  return spi_xmit(data);
 }
 
 // Send 16 bit, no read
@@ -226,3 +468,44 @@ unsigned char spi_mastertransmit_32(unsigned long data)
   spi_mastertransmit_nr((data >> 8) & 0xFF);
   return spi_mastertransmit(data & 0xFF);
 }
+
+// Read n bytes of program memory (word != 0) or eeprom into buf with the
+// read instruction op, starting at the 16 bit address addr. Program memory
+// is read low byte, high byte per word. The caller loads the extended
+// address, the range must not cross a 64K word boundary.
+void spi_read_block(unsigned char *buf, unsigned char op, unsigned int addr, unsigned int n, unsigned char word)
+{
+  unsigned char op_hi = op | (1 << 3);
+
+  SCK_LOW;
+  if (word) {
+    while (n >= 2) {
+      wdt_reset();
+      spi_xmit(op);
+      spi_xmit(addr >> 8);
+      spi_xmit(addr & 0xFF);
+      *buf++ = spi_xmit(0);
+      spi_xmit(op_hi);
+      spi_xmit(addr >> 8);
+      spi_xmit(addr & 0xFF);
+      *buf++ = spi_xmit(0);
+      addr++;
+      n -= 2;
+    }
+    if (n) {
+      spi_xmit(op);
+      spi_xmit(addr >> 8);
+      spi_xmit(addr & 0xFF);
+      *buf = spi_xmit(0);
+    }
+  } else {
+    while (n--) {
+      wdt_reset();
+      spi_xmit(op);
+      spi_xmit(addr >> 8);
+      spi_xmit(addr & 0xFF);
+      *buf++ = spi_xmit(0);
+      addr++;
+    }
+  }
+}
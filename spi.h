@@ -14,21 +14,48 @@
 #define RST_LOW           PORTB &= ~(1 << PB0)        // Target reset pin low
 #define RST_HIGH          PORTB |= (1 << PB0)         // Target reset pin high
 #define SCK_DELAY         _delay_loop_1(d_sck_dur)    // Delay for d_sck_dur ms
-#define SCK_LOW           PORTD &= ~(1 << PD2)        // SCK pin low
-#define SCK_HIGH          PORTD |= (1 << PD2)         // SCK pin high
-#define MISO_READ         PIND & (1 << PIND3)         // MISO pin value
-#define MOSI_LOW          PORTD &= ~(1 << PD4)        // MOSI pin low
-#define MOSI_HIGH         PORTD |= (1 << PD4)         // MOSI pin high
+
+// Target SPI wiring. The avrusb500v3 board uses software SPI on port D.
+// Define SPI_HW for boards wired to the hardware SPI pins of port B,
+// fast SCK settings then use the SPI peripheral, slow ones bit-bang the
+// same pins.
+#ifdef SPI_HW
+#define SPI_PORT          PORTB
+#define SPI_DDR           DDRB
+#define SPI_PIN           PINB
+#define SCK_BIT           PB5
+#define MISO_BIT          PB4
+#define MOSI_BIT          PB3
+#else
+#define SPI_PORT          PORTD
+#define SPI_DDR           DDRD
+#define SPI_PIN           PIND
+#define SCK_BIT           PD2
+#define MISO_BIT          PD3
+#define MOSI_BIT          PD4
+#endif
+
+#define SCK_LOW           SPI_PORT &= ~(1 << SCK_BIT)   // SCK pin low
+#define SCK_HIGH          SPI_PORT |= (1 << SCK_BIT)    // SCK pin high
+#define MISO_READ         SPI_PIN & (1 << MISO_BIT)     // MISO pin value
+#define MOSI_LOW          SPI_PORT &= ~(1 << MOSI_BIT)  // MOSI pin low
+#define MOSI_HIGH         SPI_PORT |= (1 << MOSI_BIT)   // MOSI pin high
 
 extern void spi_init(void);
 extern unsigned char spi_set_sck_duration(unsigned char dur);
 extern unsigned char spi_get_sck_duration(void);
+extern void spi_set_sck_fast(unsigned char on);
+extern unsigned char spi_get_sck_fast(void);
 extern void spi_mastertransmit_nr(unsigned char data);
 extern unsigned char spi_mastertransmit(unsigned char data);
 extern void spi_mastertransmit_16_nr(unsigned int data);
 extern unsigned char spi_mastertransmit_32(unsigned long data);
+extern void spi_read_block(unsigned char *buf, unsigned char op, unsigned int addr, unsigned int n, unsigned char word);
 extern void spi_disable(void);
 extern void spi_reset_pulse(void);
 extern void spi_sck_pulse(void);
+extern unsigned long spi_stats_bytes(void);
+extern unsigned long spi_stats_time(void);   // in 1/TIMER_TICKS_MS ms
+extern void spi_stats_clear(void);
 
 #endif /* SPI_H */
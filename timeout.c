@@ -1,6 +1,8 @@
 /* vim: set sw=2 ts=2 si et: */
 /*********************************************
 * Timer for timeout supervision of the stk 500 protocol
+* Timer0 gives a 1ms tick, delays and deadlines are based on it
+* so they are exact while interrupts run.
 *
 * Modified by: Clancy Palmer
 * Original Author: Guido Socher
@@ -8,15 +10,144 @@
 * Copyright: GPL
 **********************************************/
 
-#include <util/delay.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
 #include "timeout.h"
+#include "hal.h"
+
+// Timer0 in CTC mode: 18.432MHz / 256 / 72 = exactly 1kHz
+#define TIMER0_TOP ((F_CPU / 256 / 1000) - 1)
+
+static volatile uint16_t tick_ms = 0;
+// wait statistics in 1/TIMER_TICKS_MS ms
+static uint32_t wait_requested = 0;
+static uint32_t wait_blocked = 0;
+static uint32_t wait_overshoot = 0;    // past the deadlines, not in wait_blocked
+
+ISR(TIMER0_COMPA_vect)
+{
+  tick_ms++;
+}
+
+/* start the 1ms tick, Timer1 is used by clk_start() */
+void timer_init(void)
+{
+  TCNT0 = 0;
+  OCR0A = TIMER0_TOP;
+  TCCR0A = (1 << WGM01);
+  TCCR0B = (1 << CS02); // clk/256
+  TIMSK0 = (1 << OCIE0A);
+}
+
+/* current time in 1/TIMER_TICKS_MS ms, wraps after 8.19s */
+uint16_t timer_now(void)
+{
+  uint16_t ms;
+  uint8_t t;
+  uint8_t sreg = SREG;
+
+  cli();
+  ms = tick_ms;
+  t = TCNT0;
+  if ((TIFR0 & (1 << OCF0A)) && t < (TIMER0_TOP + 1) / 2) {
+    // the counter wrapped but the interrupt did not run yet
+    ms++;
+  }
+  SREG = sreg;
+  return (ms * TIMER_TICKS_MS) + t / ((TIMER0_TOP + 1) / TIMER_TICKS_MS);
+}
+
+/* time in ms, wraps after 65.5s */
+uint16_t millis(void)
+{
+  uint16_t ms;
+  uint8_t sreg = SREG;
+
+  cli();
+  ms = tick_ms;
+  SREG = sreg;
+  return ms;
+}
+
+/* deadline <ms> after the timer_now() value t, at least <ms> later
+ * than t even if t was taken just before a tick. ms < 4000 */
+uint16_t timer_after(uint16_t t, unsigned int ms)
+{
+  if (ms == 0) {
+    return t;
+  }
+  // one tick more: t may be late in its tick
+  wait_requested += ms * TIMER_TICKS_MS + 1;
+  return t + ms * TIMER_TICKS_MS + 1;
+}
+
+/* deadline <ms> from now */
+uint16_t timer_deadline(unsigned int ms)
+{
+  return timer_after(timer_now(), ms);
+}
+
+unsigned char timer_expired(uint16_t deadline)
+{
+  return (int16_t)(timer_now() - deadline) >= 0;
+}
+
+/* wait for a deadline, interrupts (UART, ADC) keep running */
+void timer_wait(uint16_t deadline)
+{
+  uint16_t t = timer_now();
+
+  if ((int16_t)(t - deadline) >= 0) {
+    return;
+  }
+  while (!timer_expired(deadline)) {
+    HAL_IDLE();
+  }
+  // blocked up to the deadline, the rest is the overshoot of the wait
+  // itself (tick resolution, interrupts) and was never asked for
+  wait_blocked += (uint16_t)(deadline - t);
+  wait_overshoot += (uint16_t)(timer_now() - deadline);
+}
 
 /* delay for a minimum of <ms> */
 void delay_ms(unsigned int ms)
 {
-  // Calibrated macro that is more accurate and not as compiler dependent as self made code.
-  while (ms) {
-    _delay_ms(0.96);
-    ms--;
+  while (ms > 4000) {
+    timer_wait(timer_deadline(4000));
+    ms -= 4000;
   }
+  timer_wait(timer_deadline(ms));
+}
+
+/* ms of delays asked for and ms spent waiting for them, the
+ * difference was used for other work */
+uint16_t timer_wait_requested_ms(void)
+{
+  uint32_t ms = wait_requested / TIMER_TICKS_MS;
+  return ms > 0xFFFF ? 0xFFFF : ms;
+}
+
+uint16_t timer_wait_blocked_ms(void)
+{
+  uint32_t ms = wait_blocked / TIMER_TICKS_MS;
+  return ms > 0xFFFF ? 0xFFFF : ms;
+}
+
+/* time spent waiting in 1/TIMER_TICKS_MS ms */
+uint32_t timer_wait_blocked_ticks(void)
+{
+  return wait_blocked;
+}
+
+/* time timer_wait() returned after its deadlines in 1/TIMER_TICKS_MS ms */
+uint32_t timer_wait_overshoot_ticks(void)
+{
+  return wait_overshoot;
+}
+
+void timer_wait_clear(void)
+{
+  wait_requested = 0;
+  wait_blocked = 0;
+  wait_overshoot = 0;
 }
@@ -11,6 +11,24 @@
 #ifndef TOUT_H
 #define TOUT_H
 
+#include <stdint.h>
+
+// resolution of timer_now()
+#define TIMER_TICKS_MS 8
+
 extern void delay_ms(unsigned int ms);
+extern void timer_init(void);
+extern uint16_t timer_now(void);
+extern uint16_t millis(void);
+// deadlines are timer_now() values
+extern uint16_t timer_after(uint16_t t, unsigned int ms);
+extern uint16_t timer_deadline(unsigned int ms);
+extern unsigned char timer_expired(uint16_t deadline);
+extern void timer_wait(uint16_t deadline);
+extern uint16_t timer_wait_requested_ms(void);
+extern uint16_t timer_wait_blocked_ms(void);
+extern uint32_t timer_wait_blocked_ticks(void);
+extern uint32_t timer_wait_overshoot_ticks(void);
+extern void timer_wait_clear(void);
 
 #endif /* TOUT_H */
@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+# vim: set sw=4 ts=4 si et:
+#
+# Throughput benchmark for every STK500v2 command handled by programcmd().
+# Runs against a real programmer (serial port) or the host build:
+#
+#   tools/bench.py /dev/ttyACM0
+#   tools/bench.py --sim sim/avrusb500v3-sim
+#
+# Reports commands per second, payload bytes per second and the number of
+# answers that did not return STATUS_CMD_OK (CMD_FIRMWARE_UPGRADE always
+# fails), --json for machine readable output. With firmware that has the
+# Timer0 timebase it also reports how long the delays asked for were and
+# how much of that the main loop actually spent blocked. --profile runs it
+# with another SPI byte delay profile (the stored one is restored after).
+# ENTER_RECONNECT is the ENTER latency with the fast reconnect grace window.
+# --baud negotiates a faster UART rate first, --fast sets PARAM_EXT_SCK_FAST
+# (2.304MHz SCK at --sck 0, the target must run at 14MHz or more). The target is expected to be an ATmega328P
+# (the simulated target is one).
+#
+# Author: Clancy Palmer
+# License: GPL
+
+import argparse
+import json
+import sys
+import time
+
+import stk500 as s
+
+# ATmega328P settings as used by avrdude
+ENTER = [s.CMD_ENTER_PROGMODE_ISP, 200, 100, 25, 32, 0, 0x53, 3, 0xAC, 0x53, 0x00, 0x00]
+LEAVE = [s.CMD_LEAVE_PROGMODE_ISP, 1, 1]
+ERASE = [s.CMD_CHIP_ERASE_ISP, 9, 1, 0xAC, 0x80, 0x00, 0x00]
+# pollMethod 0, the programmer waits eraseDelay (10ms), avrdude for most parts
+ERASE_DELAY = [s.CMD_CHIP_ERASE_ISP, 10, 0, 0xAC, 0x80, 0x00, 0x00]
+FLASH_PAGE = 128
+EEPROM_PAGE = 4
+
+
+def load_address(addr):
+    return [s.CMD_LOAD_ADDRESS, (addr >> 24) & 0xFF, (addr >> 16) & 0xFF, (addr >> 8) & 0xFF, addr & 0xFF]
+
+
+def program_flash(data):
+    n = len(data)
+    return [s.CMD_PROGRAM_FLASH_ISP, n >> 8, n & 0xFF, 0xC1, 6, 0x40, 0x4C, 0x20, 0xFF, 0xFF] + list(data)
+
+
+def program_eeprom(data):
+    n = len(data)
+    return [s.CMD_PROGRAM_EEPROM_ISP, n >> 8, n & 0xFF, 0xC1, 20, 0xC1, 0xC2, 0xA0, 0xFF, 0xFF] + list(data)
+
+
+def pattern(n, seed):
+    return bytes(((i * 7 + seed) & 0xFF) for i in range(n))
+
+
+class Bench:
+    def __init__(self, port):
+        self.port = port
+        self.results = []
+
+    def run(self, name, count, setup, body, payload=0, min_ms=0):
+        """Time count executions of body(i), setup(i) runs untimed before each.
+        An answer sooner than min_ms counts as failed."""
+        elapsed = 0.0
+        failed = 0
+        for i in range(count):
+            if setup:
+                setup(i)
+            cmd = body(i)
+            t = time.monotonic()
+            answer = self.port.command(cmd)
+            t = time.monotonic() - t
+            elapsed += t
+            if len(answer) < 2 or answer[1] != s.STATUS_CMD_OK or 1000.0 * t < min_ms:
+                failed += 1
+        self.results.append({
+            'command': name,
+            'count': count,
+            'failed': failed,
+            'seconds': elapsed,
+            'cmds_per_s': count / elapsed,
+            'bytes_per_s': payload * count / elapsed,
+            'ms_per_cmd': 1000.0 * elapsed / count,
+        })
+
+    def cmd(self, body):
+        answer = self.port.command(body)
+        if len(answer) < 2 or answer[1] != s.STATUS_CMD_OK:
+            raise s.ProtocolError('command 0x%02x failed: %s' % (body[0], answer.hex()))
+        return answer
+
+    def all(self, n):
+        p = self.port
+        self.run('SIGN_ON', n, None, lambda i: [s.CMD_SIGN_ON])
+        self.run('SET_PARAMETER', n, None, lambda i: [s.CMD_SET_PARAMETER, 0x98, 0x00])
+        self.run('GET_PARAMETER', n, None, lambda i: [s.CMD_GET_PARAMETER, 0x90])
+        self.run('LOAD_ADDRESS', n, None, lambda i: load_address(i * 64))
+        self.run('FIRMWARE_UPGRADE', n, None, lambda i: [s.CMD_FIRMWARE_UPGRADE, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0])
+        self.run('ENTER_PROGMODE_ISP', max(n // 10, 3), lambda i: p.command(LEAVE), lambda i: ENTER)
+        self.run('LEAVE_PROGMODE_ISP', max(n // 10, 3), lambda i: self.cmd(ENTER), lambda i: LEAVE)
+        # fast reconnect, LEAVE parks the target in reset for 2s
+        answer = p.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_RECONNECT_GRACE, 20])
+        if answer[1:2] == bytes([s.STATUS_CMD_OK]):
+            self.cmd(ENTER)
+            self.run('ENTER_RECONNECT', max(n // 10, 3), lambda i: self.cmd(LEAVE), lambda i: ENTER)
+            self.cmd(LEAVE)
+            p.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_RECONNECT_GRACE, 0])
+        self.cmd(ENTER)
+        self.run('CHIP_ERASE_ISP', max(n // 10, 3), None, lambda i: ERASE)
+        self.run('CHIP_ERASE_DELAY', max(n // 10, 3), None, lambda i: ERASE_DELAY, min_ms=ERASE_DELAY[1])
+        self.run('PROGRAM_FLASH_ISP', n, lambda i: self.cmd(load_address(i * FLASH_PAGE // 2)),
+                 lambda i: program_flash(pattern(FLASH_PAGE, i)), FLASH_PAGE)
+        self.run('READ_FLASH_ISP', n, lambda i: self.cmd(load_address(i * 128)),
+                 lambda i: [s.CMD_READ_FLASH_ISP, 1, 0, 0x20], 256)
+        self.run('PROGRAM_EEPROM_ISP', n, lambda i: self.cmd(load_address(i * EEPROM_PAGE)),
+                 lambda i: program_eeprom(pattern(EEPROM_PAGE, i)), EEPROM_PAGE)
+        self.run('READ_EEPROM_ISP', n, lambda i: self.cmd(load_address(i * 256 % 1024)),
+                 lambda i: [s.CMD_READ_EEPROM_ISP, 1, 0, 0xA0], 256)
+        self.run('PROGRAM_FUSE_ISP', max(n // 10, 3), None, lambda i: [s.CMD_PROGRAM_FUSE_ISP, 0xAC, 0xA0, 0x00, 0x62])
+        self.run('READ_FUSE_ISP', n, None, lambda i: [s.CMD_READ_FUSE_ISP, 4, 0x50, 0x00, 0x00, 0x00])
+        self.run('PROGRAM_LOCK_ISP', max(n // 10, 3), None, lambda i: [s.CMD_PROGRAM_LOCK_ISP, 0xAC, 0xE0, 0x00, 0xFF])
+        self.run('READ_LOCK_ISP', n, None, lambda i: [s.CMD_READ_LOCK_ISP, 4, 0x58, 0x00, 0x00, 0x00])
+        self.run('READ_SIGNATURE_ISP', n, None, lambda i: [s.CMD_READ_SIGNATURE_ISP, 4, 0x30, 0x00, i % 3, 0x00])
+        self.run('READ_OSCCAL_ISP', n, None, lambda i: [s.CMD_READ_OSCCAL_ISP, 4, 0x38, 0x00, 0x00, 0x00])
+        self.run('SPI_MULTI', n, None, lambda i: [s.CMD_SPI_MULTI, 4, 4, 0, 0x30, 0x00, 0x00, 0x00])
+        self.cmd(LEAVE)
+
+
+PROFILES = {'conservative': 0, 'datasheet': 1, 'zero': 2}
+
+
+def read_param16(port, low):
+    """Vendor counter split in a low and high parameter, None if unknown."""
+    lo = port.command([s.CMD_GET_PARAMETER, low])
+    hi = port.command([s.CMD_GET_PARAMETER, low + 1])
+    if len(lo) < 3 or len(hi) < 3 or lo[1] != s.STATUS_CMD_OK or hi[1] != s.STATUS_CMD_OK:
+        return None
+    return lo[2] | (hi[2] << 8)
+
+
+def wait_stats(port):
+    requested = read_param16(port, s.PARAM_EXT_WAIT_REQUESTED_LOW)
+    blocked = read_param16(port, s.PARAM_EXT_WAIT_BLOCKED_LOW)
+    if requested is None or blocked is None:
+        return None
+    waits = {'requested_ms': requested, 'blocked_ms': blocked, 'recovered_ms': requested - blocked}
+    perf = s.read_perf(port)
+    if perf and 'delay_overshoot' in perf:
+        waits['overshoot_ms'] = perf['delay_overshoot']
+    return waits
+
+
+def wait_ready(port, timeout=10.0):
+    """The programmer blinks its LED for about 1.3s after power up."""
+    end = time.monotonic() + timeout
+    while True:
+        try:
+            port.drain(0)
+            return port.command([s.CMD_SIGN_ON], timeout=0.5)
+        except s.ProtocolError:
+            if time.monotonic() > end:
+                raise
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__)
+    ap.add_argument('port', nargs='?', help='serial port of the programmer')
+    ap.add_argument('--sim', metavar='BINARY', help='start the host build and use its pty')
+    ap.add_argument('-n', type=int, default=20, help='iterations per command (default 20)')
+    ap.add_argument('--sck', type=int, default=0, help='PARAM_SCK_DURATION (default 0)')
+    ap.add_argument('--fast', action='store_true', help='2.304MHz SCK at --sck 0 (PARAM_EXT_SCK_FAST)')
+    ap.add_argument('--baud', type=int, default=115200, choices=sorted(s.BAUD_CODES),
+                    help='negotiate this UART baud rate first (default 115200)')
+    ap.add_argument('--profile', choices=sorted(PROFILES), help='SPI byte delay profile for the run')
+    ap.add_argument('--json', action='store_true', help='machine readable output')
+    args = ap.parse_args()
+    if not args.port and not args.sim:
+        ap.error('need a port or --sim')
+
+    proc = None
+    path = args.port
+    if args.sim:
+        proc, path = s.start_sim(args.sim)
+    try:
+        port = s.Port(path)
+        wait_ready(port)
+        if args.baud != 115200:
+            port.negotiate(args.baud)
+        port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_SCK_FAST, 1 if args.fast else 0])
+        port.command([s.CMD_SET_PARAMETER, 0x98, args.sck])
+        port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_WAIT_REQUESTED_LOW, 0])
+        stored = None
+        if args.profile:
+            answer = port.command([s.CMD_GET_PARAMETER, s.PARAM_EXT_DELAY_PROFILE])
+            if len(answer) < 3 or answer[1] != s.STATUS_CMD_OK:
+                raise s.ProtocolError('firmware has no delay profiles')
+            stored = answer[2]
+            port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_DELAY_PROFILE, PROFILES[args.profile]])
+        bench = Bench(port)
+        try:
+            bench.all(args.n)
+        finally:
+            if stored is not None:
+                port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_DELAY_PROFILE, stored])
+        waits = wait_stats(port)
+    finally:
+        if proc:
+            s.stop_sim(proc)
+
+    if args.json:
+        json.dump({'sck_duration': args.sck, 'sck_fast': args.fast, 'baud': args.baud, 'profile': args.profile, 'results': bench.results, 'waits': waits}, sys.stdout, indent=1)
+        print()
+        return
+    print('%-20s %6s %6s %10s %10s %12s' % ('command', 'count', 'failed', 'ms/cmd', 'cmds/s', 'bytes/s'))
+    for r in bench.results:
+        print('%-20s %6d %6d %10.2f %10.1f %12.0f' % (r['command'], r['count'], r['failed'], r['ms_per_cmd'],
+                                                      r['cmds_per_s'], r['bytes_per_s']))
+    if waits:
+        print('delays: %(requested_ms)d ms requested, %(blocked_ms)d ms blocked, %(recovered_ms)d ms recovered' % waits)
+        if 'overshoot_ms' in waits:
+            print('        %(overshoot_ms).1f ms past the deadlines' % waits)
+
+
+if __name__ == '__main__':
+    main()
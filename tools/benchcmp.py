@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+# vim: set sw=4 ts=4 si et:
+#
+# Compare two benchmark results (JSON from sim/simavr_bench or
+# tools/bench.py --json) and fail on regressions:
+#
+#   tools/benchcmp.py [--tolerance 2] bench.json bench-baseline.json
+#
+# Cycle counts and times must not grow, throughputs and SCK frequency
+# must not drop by more than the tolerance (percent). Without a baseline
+# file the results are only printed.
+#
+# Author: Clancy Palmer
+# License: GPL
+
+import argparse
+import json
+import os
+import sys
+
+# metric name -> 1 if larger is better, -1 if smaller is better
+LOWER = -1
+HIGHER = 1
+
+
+def direction(metric):
+    if metric in ('kbytes_per_s', 'bytes_per_s', 'cmds_per_s', 'sck_hz'):
+        return HIGHER
+    if metric in ('cycles', 'seconds', 'ms_per_cmd', 'failed') or metric.endswith('cycles_per_byte'):
+        return LOWER
+    return None
+
+
+def key(result):
+    return result.get('bench') or result.get('command')
+
+
+def load(name):
+    with open(name) as f:
+        data = json.load(f)
+    # tools/bench.py wraps its list in an object
+    if isinstance(data, dict):
+        data = data['results']
+    return data
+
+
+def main():
+    p = argparse.ArgumentParser(description='compare benchmark results against a baseline')
+    p.add_argument('--tolerance', type=float, default=2.0, help='allowed regression in percent')
+    p.add_argument('result')
+    p.add_argument('baseline')
+    a = p.parse_args()
+
+    results = load(a.result)
+    if not os.path.exists(a.baseline):
+        for r in results:
+            print(json.dumps(r))
+        print('%s: no baseline, copy %s to %s to enable the regression check'
+              % (sys.argv[0], a.result, a.baseline))
+        return 0
+    baseline = dict((key(r), r) for r in load(a.baseline))
+
+    regressions = 0
+    for r in results:
+        b = baseline.get(key(r))
+        if b is None:
+            print('%-20s new' % key(r))
+            continue
+        for metric, value in sorted(r.items()):
+            d = direction(metric)
+            old = b.get(metric)
+            if d is None or not isinstance(value, (int, float)) or not isinstance(old, (int, float)):
+                continue
+            if old == 0:
+                change = 0.0 if value == 0 else 100.0
+            else:
+                change = 100.0 * (value - old) / old
+            bad = change * d < -a.tolerance
+            if bad or abs(change) > a.tolerance:
+                print('%-20s %-28s %12.1f -> %12.1f %+7.2f%%%s'
+                      % (key(r), metric, old, value, change, '  REGRESSION' if bad else ''))
+            regressions += bad
+    if regressions:
+        print('%d regression(s) beyond %.1f%%' % (regressions, a.tolerance))
+        return 1
+    print('no regressions beyond %.1f%%' % a.tolerance)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+# vim: set sw=4 ts=4 si et:
+#
+# Times writing the whole EEPROM with CMD_PROGRAM_EEPROM_ISP the way hosts
+# do it: word mode with data polling (avrdude for the ATmega8 and older
+# parts, 128 bytes per message) and page mode with RDY/BSY polling (4 byte
+# pages, avrdude for the ATmega328P), each with the PARAM_EXT_EEPROM
+# settings off and on. Every run is read back and compared. The rewrite
+# runs program the image again with 1 in 16 bytes changed, with and
+# without EEPROM_SKIP_UNCHANGED:
+#
+#   tools/eebench.py --sim sim/avrusb500v3-sim
+#   tools/eebench.py --sim sim/avrusb500v3-sim --eeprom-us 1000
+#   tools/eebench.py /dev/ttyACM0 --size 1024 --json
+#
+# Firmware without PARAM_EXT_EEPROM runs only the runs with it off, point
+# --sim at an older build to compare. The target is expected to be an
+# ATmega328P (the simulated target is one). --eeprom-us sets the EEPROM
+# write time of the simulated target, for parts faster or slower than its
+# 3.6ms; the runs must verify with any of them.
+#
+# Author: Clancy Palmer
+# License: GPL
+
+import argparse
+import json
+import os
+import random
+import sys
+import time
+
+import stk500 as s
+from bench import ENTER, LEAVE, load_address, wait_ready
+
+EEPROM_PAGE = 4
+WORD_BLOCK = 128
+
+# name, host mode, PARAM_EXT_EEPROM value, rewrite
+RUNS = [
+    ('word', 'word', 0, False),
+    ('word rdy/bsy', 'word', s.EEPROM_RDY_BSY, False),
+    ('word as pages', 'word', s.EEPROM_RDY_BSY | (2 << s.EEPROM_PAGE_SHIFT), False),
+    ('page', 'page', 0, False),
+    ('page rdy/bsy', 'page', s.EEPROM_RDY_BSY, False),
+    ('word rewrite', 'word', 0, True),
+    ('word rewrite skip', 'word', s.EEPROM_RDY_BSY | s.EEPROM_SKIP_UNCHANGED | (2 << s.EEPROM_PAGE_SHIFT), True),
+    ('page rewrite', 'page', 0, True),
+    ('page rewrite skip', 'page', s.EEPROM_RDY_BSY | s.EEPROM_SKIP_UNCHANGED, True),
+]
+
+
+def eeprom_image(size, seed):
+    """Settings and tables with erased gaps: about a third is 0xFF, the
+    poll value, which data polling can not be used for."""
+    rnd = random.Random(seed)
+    return bytes(0xFF if rnd.random() < 0.33 else rnd.randrange(0xFF) for _ in range(size))
+
+
+def program(port, image, mode):
+    """Write image from address 0, return seconds."""
+    t = time.monotonic()
+    if mode == 'word':
+        block = WORD_BLOCK
+        header = [0x04, 20, 0xC0, 0x00, 0xA0, 0xFF, 0xFF]
+    else:
+        block = EEPROM_PAGE
+        header = [0xC1, 20, 0xC1, 0xC2, 0xA0, 0xFF, 0xFF]
+    port.command(load_address(0))
+    for a in range(0, len(image), block):
+        data = image[a:a + block]
+        answer = port.command([s.CMD_PROGRAM_EEPROM_ISP, len(data) >> 8, len(data) & 0xFF] + header + list(data),
+                              timeout=30)
+        if answer[1] != s.STATUS_CMD_OK:
+            raise s.ProtocolError('EEPROM 0x%04x: %s' % (a, answer.hex()))
+    return time.monotonic() - t
+
+
+def verify(port, image):
+    port.command(load_address(0))
+    for a in range(0, len(image), 256):
+        n = min(256, len(image) - a)
+        answer = port.command([s.CMD_READ_EEPROM_ISP, n >> 8, n & 0xFF, 0xA0])
+        if answer[2:2 + n] != image[a:a + n]:
+            raise s.ProtocolError('verify failed at 0x%04x' % a)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__)
+    ap.add_argument('port', nargs='?', help='serial port of the programmer')
+    ap.add_argument('--sim', metavar='BINARY', help='start the host build and use its pty')
+    ap.add_argument('--size', type=int, default=1024, help='EEPROM size in bytes (default 1024)')
+    ap.add_argument('--eeprom-us', type=int, metavar='US',
+                    help='EEPROM write time of the simulated target in microseconds (default 3600)')
+    ap.add_argument('--json', action='store_true', help='machine readable output')
+    args = ap.parse_args()
+    if not args.port and not args.sim:
+        ap.error('need a port or --sim')
+
+    results = []
+    proc = None
+    path = args.port
+    if args.sim:
+        env = None
+        if args.eeprom_us:
+            env = dict(os.environ, AVRUSB_SIM_EEPROM_US=str(args.eeprom_us))
+        proc, path = s.start_sim(args.sim, env=env)
+    try:
+        port = s.Port(path)
+        wait_ready(port)
+        answer = port.command([s.CMD_GET_PARAMETER, s.PARAM_EXT_EEPROM])
+        engine = answer[1] == s.STATUS_CMD_OK
+        perf = engine and s.read_perf(port) is not None
+        port.command(ENTER)
+        for i, (name, mode, setting, rewrite) in enumerate(RUNS):
+            if setting and not engine:
+                continue
+            image = eeprom_image(args.size, i)
+            if rewrite:
+                # the target holds the image, a few bytes change
+                port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_EEPROM, s.EEPROM_RDY_BSY if engine else 0])
+                program(port, image, 'page')
+                image = bytes((b ^ 0x5A) if j % 16 == 0 else b for j, b in enumerate(image))
+            if engine:
+                port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_EEPROM, setting])
+            if perf:
+                s.clear_perf(port)
+            seconds = program(port, image, mode)
+            unchanged = s.read_perf(port)['eeprom_unchanged'] if perf else None
+            verify(port, image)
+            results.append({
+                'run': name,
+                'setting': setting,
+                'bytes': args.size,
+                'seconds': seconds,
+                'ms_per_byte': 1000.0 * seconds / args.size,
+                'unchanged_bytes': unchanged,
+            })
+        if engine:
+            port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_EEPROM, 0])
+        port.command(LEAVE)
+    finally:
+        if proc:
+            s.stop_sim(proc)
+
+    if args.json:
+        json.dump(results, sys.stdout, indent=1)
+        print()
+        return
+    if not engine:
+        print('firmware has no PARAM_EXT_EEPROM, only the default runs', file=sys.stderr)
+    print('%-20s %8s %10s %10s %10s' % ('run', '0xFE', 'seconds', 'ms/byte', 'unchanged'))
+    for r in results:
+        print('%-20s %8s %10.2f %10.2f %10s' %
+              (r['run'], '0x%02x' % r['setting'], r['seconds'], r['ms_per_byte'],
+               '-' if r['unchanged_bytes'] is None else r['unchanged_bytes']))
+
+
+if __name__ == '__main__':
+    main()
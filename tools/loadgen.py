@@ -0,0 +1,319 @@
+#!/usr/bin/env python3
+# vim: set sw=4 ts=4 si et:
+#
+# STK500v2 load generator: sends a weighted mix of commands back to back
+# the way production jobs do and reports round trip latency (p50, p99,
+# max) per command type and the sustained frames per second:
+#
+#   tools/loadgen.py --sim sim/avrusb500v3-sim -n 5000
+#   tools/loadgen.py /dev/ttyACM0 --mix get=4,load=2,flash=1 --window 2
+#
+# --window 2 sends the next frame before the answer to the previous one
+# arrived, the firmware receives one message while it processes the other.
+# --early sets PARAM_EXT_EARLY_ANSWER: flash pages are answered before the
+# write finished, so a third frame comes in while the first still polls
+# and the second waits. --corrupt P sends a fraction P of
+# the frames with a wrong checksum. Answers with a wrong checksum and
+# ANSWER_CKSUM_ERROR answers are counted separately, the latter split in
+# expected (corrupted by us) and unexpected ones. --perf adds the
+# performance counters of the programmer for the run (tools/perfdump.py).
+#
+# Author: Clancy Palmer
+# License: GPL
+
+import argparse
+import collections
+import json
+import math
+import random
+import sys
+import time
+
+import stk500 as s
+from bench import ENTER, LEAVE, ERASE, FLASH_PAGE, load_address, pattern, wait_ready
+
+FLASH_PAGES = 32768 // FLASH_PAGE
+# host side pause after an aborted frame
+ABORT_PAUSE = 0.05
+# the flash page the next CMD_PROGRAM_FLASH_ISP writes, set by 'load'
+state = {'page': 0}
+
+
+def cmd_sign_on(r):
+    return [s.CMD_SIGN_ON]
+
+
+def cmd_get(r):
+    # PARAM_SW_MAJOR, PARAM_SW_MINOR, PARAM_VTARGET, PARAM_SCK_DURATION
+    return [s.CMD_GET_PARAMETER, r.choice([0x91, 0x92, 0x94, 0x98])]
+
+
+def cmd_set(r):
+    # PARAM_SCK_DURATION, the value avrdude uses for a fast target
+    return [s.CMD_SET_PARAMETER, 0x98, 0]
+
+
+def cmd_load(r):
+    state['page'] = r.randrange(FLASH_PAGES)
+    return load_address(state['page'] * FLASH_PAGE // 2)
+
+
+def cmd_flash(r):
+    # the address advances by one page like with avrdude
+    state['page'] = (state['page'] + 1) % FLASH_PAGES
+    data = pattern(FLASH_PAGE, state['page'])
+    return [s.CMD_PROGRAM_FLASH_ISP, FLASH_PAGE >> 8, FLASH_PAGE & 0xFF,
+            0xC1, 6, 0x40, 0x4C, 0x20, 0xFF, 0xFF] + list(data)
+
+
+def cmd_read(r):
+    return [s.CMD_READ_FLASH_ISP, FLASH_PAGE >> 8, FLASH_PAGE & 0xFF, 0x20]
+
+
+COMMANDS = {
+    'sign_on': cmd_sign_on,
+    'get': cmd_get,
+    'set': cmd_set,
+    'load': cmd_load,
+    'flash': cmd_flash,
+    'read': cmd_read,
+}
+
+
+def parse_mix(text):
+    mix = []
+    for item in text.split(','):
+        name, _, weight = item.partition('=')
+        if name not in COMMANDS:
+            raise argparse.ArgumentTypeError('unknown command %r, known: %s' % (name, ', '.join(COMMANDS)))
+        mix.append((name, int(weight or 1)))
+    return mix
+
+
+def percentile(values, p):
+    """Nearest rank percentile of a sorted list."""
+    if not values:
+        return 0.0
+    return values[max(0, math.ceil(p / 100.0 * len(values)) - 1)]
+
+
+def damage(r, msg, kind):
+    if kind == 'drop':
+        # one byte lost on the line
+        i = r.randrange(len(msg))
+        return msg[:i] + msg[i + 1:]
+    # 'abort': the host stops in the middle of the frame
+    return msg[:r.randrange(1, len(msg))]
+
+
+def run(port, mix, frames, window, corrupt, faults, seed):
+    r = random.Random(seed)
+    names = [n for n, _ in mix]
+    weights = [w for _, w in mix]
+    latency = collections.defaultdict(list)
+    counts = collections.Counter()
+    inflight = collections.deque()   # (seq, name, sent, corrupted)
+    damaged = set()                  # seqnums of frames sent with a fault
+    recovery = collections.defaultdict(list)   # seconds from a fault to the next good answer
+    fault = None                     # (kind, time) of the first fault since the last good answer
+    sent = 0
+    start = time.monotonic()
+    while sent < frames or inflight:
+        while sent < frames and len(inflight) < window:
+            name = r.choices(names, weights)[0]
+            body = COMMANDS[name](r)
+            port.seq = (port.seq + 1) & 0xFF
+            msg = s.frame(port.seq, body)
+            sent += 1
+            x = r.random()
+            if x < faults:
+                # no answer expected, the next frame follows right away
+                # ('drop') or after a pause ('abort')
+                kind = r.choice(('drop', 'abort'))
+                counts['faults_' + kind] += 1
+                damaged.add(port.seq)
+                if fault is None:
+                    fault = (kind, time.monotonic())
+                port.write(damage(r, msg, kind))
+                if kind == 'abort':
+                    time.sleep(ABORT_PAUSE)
+                continue
+            corrupted = x < faults + corrupt
+            if corrupted:
+                msg = msg[:-1] + bytes([msg[-1] ^ 0x55])
+            inflight.append((port.seq, name, time.monotonic(), corrupted))
+            port.write(msg)
+        if not inflight:
+            continue
+        try:
+            rseq, answer, ok = port.receive(timeout=2.0)
+        except s.ProtocolError:
+            # lost frame or answer: start over from a quiet line
+            counts['timeouts'] += len(inflight)
+            inflight.clear()
+            port.drain(0.1)
+            continue
+        now = time.monotonic()
+        if ok and rseq in damaged and all(f[0] != rseq for f in inflight):
+            # the programmer answered what it got of a damaged frame
+            damaged.discard(rseq)
+            counts['damaged_answers'] += 1
+            continue
+        if ok and rseq != inflight[0][0]:
+            if all(f[0] != rseq for f in inflight):
+                # not one of ours, e.g. the seqnum byte of a damaged frame was lost
+                counts['stray_answers'] += 1
+                continue
+            # the answer to a later frame: the ones before it were lost
+            counts['seqnum_mismatches'] += 1
+            while inflight[0][0] != rseq:
+                inflight.popleft()
+        seq, name, t, corrupted = inflight.popleft()
+        if not ok:
+            counts['answer_checksum_failures'] += 1
+        elif answer and answer[0] == s.ANSWER_CKSUM_ERROR:
+            counts['cksum_error_answers_expected' if corrupted else 'cksum_error_answers_unexpected'] += 1
+        elif corrupted:
+            counts['corrupted_accepted'] += 1
+        else:
+            if len(answer) < 2 or answer[1] != s.STATUS_CMD_OK:
+                counts['status_errors'] += 1
+            latency[name].append(now - t)
+            if fault is not None:
+                recovery[fault[0]].append(now - fault[1])
+                fault = None
+    seconds = time.monotonic() - start
+    return latency, counts, recovery, sent, seconds
+
+
+def read_rx_counters(port):
+    """Parser timeouts and resyncs of the programmer, {} if it has none."""
+    out = {}
+    for key, param in (('rx_timeouts', s.PARAM_EXT_RX_TIMEOUTS), ('rx_resyncs', s.PARAM_EXT_RX_RESYNCS)):
+        answer = port.command([s.CMD_GET_PARAMETER, param])
+        if len(answer) < 3 or answer[1] != s.STATUS_CMD_OK:
+            return {}
+        out[key] = answer[2]
+    return out
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__)
+    ap.add_argument('port', nargs='?', help='serial port of the programmer')
+    ap.add_argument('--sim', metavar='BINARY', help='start the host build and use its pty')
+    ap.add_argument('-n', '--frames', type=int, default=2000, help='frames to send (default 2000)')
+    ap.add_argument('--mix', type=parse_mix, default=parse_mix('get=4,load=2,flash=1'),
+                    help='command=weight list of %s (default get=4,load=2,flash=1)' % ','.join(COMMANDS))
+    ap.add_argument('--window', type=int, default=1, choices=(1, 2), help='frames in flight (default 1)')
+    ap.add_argument('--corrupt', type=float, default=0.0, metavar='P',
+                    help='fraction of frames sent with a wrong checksum')
+    ap.add_argument('--faults', type=float, default=0.0, metavar='P',
+                    help='fraction of frames damaged on the way: a byte dropped, or cut short '
+                         'followed by a pause')
+    ap.add_argument('--early', action='store_true', help='answer flash page writes before polling (0xE2)')
+    ap.add_argument('--seed', type=int, default=1)
+    ap.add_argument('--baud', type=int, default=115200, choices=sorted(s.BAUD_CODES),
+                    help='negotiate this UART baud rate first (default 115200)')
+    ap.add_argument('--perf', action='store_true', help='report the performance counters of the programmer')
+    ap.add_argument('--json', action='store_true', help='machine readable output')
+    args = ap.parse_args()
+    if not args.port and not args.sim:
+        ap.error('need a port or --sim')
+
+    perf = None
+    proc = None
+    path = args.port
+    if args.sim:
+        proc, path = s.start_sim(args.sim)
+    try:
+        port = s.Port(path)
+        wait_ready(port)
+        if args.baud != 115200:
+            port.negotiate(args.baud)
+        port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_RX_TIMEOUTS, 0])
+        if args.perf:
+            s.clear_perf(port)
+        port.command(ENTER)
+        port.command(ERASE)
+        port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_EARLY_ANSWER, 1 if args.early else 0])
+        try:
+            latency, counts, recovery, sent, seconds = run(port, args.mix, args.frames, args.window,
+                                                           args.corrupt, args.faults, args.seed)
+            rx_counters = read_rx_counters(port)
+        finally:
+            port.drain()
+            port.command(LEAVE)
+        if args.perf:
+            perf = s.read_perf(port)
+    finally:
+        if proc:
+            s.stop_sim(proc)
+
+    results = []
+    for name, _ in args.mix:
+        v = sorted(latency.get(name, []))
+        results.append({
+            'command': name,
+            'count': len(v),
+            'p50_ms': percentile(v, 50) * 1000.0,
+            'p99_ms': percentile(v, 99) * 1000.0,
+            'max_ms': (v[-1] if v else 0.0) * 1000.0,
+        })
+    summary = {
+        'frames': sent,
+        'seconds': seconds,
+        'frames_per_s': sent / seconds if seconds else 0.0,
+        'window': args.window,
+        'baud': args.baud,
+    }
+    summary['recovery'] = {}
+    for kind, v in sorted(recovery.items()):
+        v.sort()
+        summary['recovery'][kind] = {
+            'count': len(v),
+            'p50_ms': percentile(v, 50) * 1000.0,
+            'p99_ms': percentile(v, 99) * 1000.0,
+            'max_ms': v[-1] * 1000.0,
+        }
+    summary.update(rx_counters)
+    for key in ('faults_drop', 'faults_abort', 'damaged_answers', 'stray_answers', 'answer_checksum_failures',
+                'cksum_error_answers_expected', 'cksum_error_answers_unexpected', 'corrupted_accepted',
+                'seqnum_mismatches', 'status_errors', 'timeouts'):
+        summary[key] = counts[key]
+    if perf is not None:
+        summary['perf'] = perf
+    if args.json:
+        json.dump({'results': results, 'summary': summary}, sys.stdout, indent=1)
+        print()
+        return
+    print('%-10s %8s %10s %10s %10s' % ('command', 'count', 'p50 ms', 'p99 ms', 'max ms'))
+    for r in results:
+        print('%-10s %8d %10.2f %10.2f %10.2f' % (r['command'], r['count'], r['p50_ms'], r['p99_ms'], r['max_ms']))
+    print('%d frames in %.2fs, %.1f frames/s (window %d, %d baud)' %
+          (sent, seconds, summary['frames_per_s'], args.window, args.baud))
+    print('answer checksum failures: %d, ANSWER_CKSUM_ERROR answers: %d expected, %d unexpected' %
+          (counts['answer_checksum_failures'], counts['cksum_error_answers_expected'],
+           counts['cksum_error_answers_unexpected']))
+    print('corrupted frames accepted: %d, seqnum mismatches: %d, status errors: %d, timeouts: %d' %
+          (counts['corrupted_accepted'], counts['seqnum_mismatches'], counts['status_errors'], counts['timeouts']))
+    if counts['faults_drop'] or counts['faults_abort']:
+        print('faults: %d dropped byte, %d aborted (%.0f ms pause), %d damaged frames answered, %d stray answers' %
+              (counts['faults_drop'], counts['faults_abort'], ABORT_PAUSE * 1000.0, counts['damaged_answers'],
+               counts['stray_answers']))
+        for kind, rc in summary['recovery'].items():
+            print('recovery after %-5s p50 %.2f ms, p99 %.2f ms, max %.2f ms (%d)' %
+                  (kind, rc['p50_ms'], rc['p99_ms'], rc['max_ms'], rc['count']))
+    if 'rx_timeouts' in rx_counters:
+        print('programmer: %d frames timed out, %d resyncs' %
+              (rx_counters['rx_timeouts'], rx_counters['rx_resyncs']))
+    if perf is not None:
+        for line in s.format_perf(perf):
+            print(line)
+    if counts['answer_checksum_failures'] or counts['cksum_error_answers_unexpected'] or \
+            counts['corrupted_accepted'] or counts['seqnum_mismatches'] or counts['timeouts'] or \
+            (counts['stray_answers'] and not (counts['faults_drop'] or counts['faults_abort'])):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,282 @@
+#!/usr/bin/env python3
+# vim: set sw=4 ts=4 si et:
+#
+# Programs a flash image page by page with CMD_PROGRAM_FLASH_ISP and with
+# CMD_EXT_PROGRAM_FLASH_PACKED, verifies both and compares bytes sent and
+# wall clock time. Verification reads the flash back, and with firmware that
+# has CMD_EXT_CHECKSUM_ISP also compares the CRC-32 computed by the
+# programmer, both are timed:
+#
+#   tools/packbench.py --sim sim/avrusb500v3-sim main.hex
+#   tools/packbench.py /dev/ttyACM0 main.out
+#   tools/packbench.py --sim sim/avrusb500v3-sim --synthetic 20000
+#
+# Images: Intel hex, AVR ELF (flash segments) or raw binary. --synthetic
+# builds an image shaped like avr-gcc output (vector table, code, .data,
+# zero filled tables) for setups without a toolchain. The target is
+# expected to be an ATmega328P (the simulated target is one). --baud
+# negotiates a faster UART rate first. --reprogram then programs the
+# image once more without chip erase and with PARAM_EXT_SKIP_UNCHANGED,
+# as after avrdude -D with the same build: pages the target already holds
+# are compared and not written.
+#
+# Author: Clancy Palmer
+# License: GPL
+
+import argparse
+import json
+import random
+import struct
+import sys
+import time
+import zlib
+
+import stk500 as s
+from bench import ENTER, LEAVE, ERASE, load_address, read_param16, wait_ready
+
+FLASH_SIZE = 32768
+
+
+def load_hex(path):
+    data = {}
+    base = 0
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith(':'):
+                continue
+            rec = bytes.fromhex(line[1:])
+            n, addr, kind = rec[0], (rec[1] << 8) | rec[2], rec[3]
+            if kind == 0:
+                for i, b in enumerate(rec[4:4 + n]):
+                    data[base + addr + i] = b
+            elif kind == 2:
+                base = ((rec[4] << 8) | rec[5]) << 4
+            elif kind == 4:
+                base = ((rec[4] << 8) | rec[5]) << 16
+    return data
+
+
+def load_elf(path):
+    """Loadable segments below 0x800000 (data memory starts there on AVR)."""
+    with open(path, 'rb') as f:
+        elf = f.read()
+    if elf[4] != 1 or elf[5] != 1:
+        raise ValueError('%s: not a 32 bit little endian ELF file' % path)
+    phoff, = struct.unpack_from('<I', elf, 28)
+    phentsize, phnum = struct.unpack_from('<HH', elf, 42)
+    data = {}
+    for i in range(phnum):
+        kind, offset, _, paddr, filesz = struct.unpack_from('<IIIII', elf, phoff + i * phentsize)
+        if kind != 1 or paddr >= 0x800000:
+            continue
+        for j, b in enumerate(elf[offset:offset + filesz]):
+            data[paddr + j] = b
+    return data
+
+
+def load_image(path):
+    with open(path, 'rb') as f:
+        head = f.read(4)
+    if head == b'\x7fELF':
+        data = load_elf(path)
+    elif head[:1] == b':':
+        data = load_hex(path)
+    else:
+        with open(path, 'rb') as f:
+            data = dict(enumerate(f.read()))
+    if not data:
+        raise ValueError('%s: no flash data' % path)
+    image = bytearray(b'\xff' * (max(data) + 1))
+    for a, b in data.items():
+        image[a] = b
+    return bytes(image)
+
+
+def synthetic_image(size, seed=1):
+    """Vector table with jmp __bad_interrupt entries, code, .data, zero
+    filled tables and string constants in the proportions of a typical
+    avr-gcc build."""
+    r = random.Random(seed)
+    img = bytearray()
+    img += bytes([0x0C, 0x94, 0x34, 0x00])
+    img += bytes([0x0C, 0x94, 0x51, 0x00]) * 25
+    strings = b'Target Voltage: \r\nEnter SW Version Major in hex [\0]: \0OK\r\n\0'
+    while len(img) < size:
+        kind = r.random()
+        if kind < 0.75:
+            # code: 16 bit instructions, ldi/mov/rjmp/call style words
+            for _ in range(r.randint(8, 64)):
+                op = r.choice([0xE0, 0x2F, 0xC0, 0x91, 0x93, 0x0E, 0x95, 0x94, 0xF4])
+                img += bytes([r.randint(0, 255), op | r.randint(0, 15)])
+        elif kind < 0.9:
+            img += bytes(r.randint(8, 96))
+        else:
+            img += strings[:r.randint(8, len(strings))]
+    return bytes(img[:size])
+
+
+def program(port, image, page, packed):
+    """Program all pages, return (seconds, bytes sent, bytes of data)."""
+    sent = 0
+    elapsed = 0.0
+    payload = 0
+    for a in range(0, len(image), page):
+        data = image[a:a + page].ljust(page, b'\xff')
+        header = [s.CMD_PROGRAM_FLASH_ISP, page >> 8, page & 0xFF, 0xC1, 6, 0x40, 0x4C, 0x20, 0xFF, 0xFF]
+        if packed:
+            header[0] = s.CMD_EXT_PROGRAM_FLASH_PACKED
+            data = s.pack(data)
+        body = header + list(data)
+        t = time.monotonic()
+        port.command(load_address(a // 2))
+        answer = port.command(body)
+        elapsed += time.monotonic() - t
+        if answer[1] != s.STATUS_CMD_OK:
+            raise s.ProtocolError('page 0x%04x: %s' % (a, answer.hex()))
+        sent += 6 + 5 + 6 + len(body)
+        payload += len(data)
+    return elapsed, sent, payload
+
+
+def verify(port, image):
+    """Read back, return (seconds, bytes sent and received)."""
+    t = time.monotonic()
+    traffic = 0
+    for a in range(0, len(image), 256):
+        port.command(load_address(a // 2))
+        answer = port.command([s.CMD_READ_FLASH_ISP, 1, 0, 0x20])
+        want = image[a:a + 256]
+        if answer[2:2 + len(want)] != want:
+            raise s.ProtocolError('verify failed at 0x%04x' % a)
+        traffic += 11 + 8 + 10 + len(answer) + 6
+    return time.monotonic() - t, traffic
+
+
+def verify_crc(port, image):
+    """CRC-32 by the programmer, return (seconds, bytes sent and received)
+    or None if the firmware does not know the command."""
+    n = len(image)
+    body = [s.CMD_EXT_CHECKSUM_ISP, 0, 0x20, 0, 0, 0, 0, n >> 24, (n >> 16) & 0xFF, (n >> 8) & 0xFF, n & 0xFF]
+    t = time.monotonic()
+    answer = port.command(body, timeout=60)
+    elapsed = time.monotonic() - t
+    if answer[1] == s.STATUS_CMD_UNKNOWN:
+        return None
+    crc = int.from_bytes(answer[2:6], 'big')
+    if answer[1] != s.STATUS_CMD_OK or crc != zlib.crc32(image):
+        raise s.ProtocolError('CRC verify failed: %s, expected %08x' % (answer.hex(), zlib.crc32(image)))
+    return elapsed, len(body) + 6 + len(answer) + 6
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__)
+    ap.add_argument('port', nargs='?', help='serial port of the programmer')
+    ap.add_argument('image', nargs='?', help='Intel hex, ELF or binary file')
+    ap.add_argument('--sim', metavar='BINARY', help='start the host build and use its pty')
+    ap.add_argument('--synthetic', type=int, metavar='SIZE', help='use a generated image of SIZE bytes')
+    ap.add_argument('--baud', type=int, default=115200, choices=sorted(s.BAUD_CODES),
+                    help='negotiate this UART baud rate first (default 115200)')
+    ap.add_argument('--page', type=int, default=128, help='flash page size in bytes (default 128)')
+    ap.add_argument('--reprogram', action='store_true',
+                    help='program again without chip erase, skipping unchanged pages')
+    ap.add_argument('--json', action='store_true', help='machine readable output')
+    args = ap.parse_args()
+    if args.sim and args.port and not args.image:
+        # only one positional: it is the image
+        args.image, args.port = args.port, None
+    if not args.port and not args.sim:
+        ap.error('need a port or --sim')
+    if args.synthetic:
+        image = synthetic_image(args.synthetic)
+    elif args.image:
+        image = load_image(args.image)
+    else:
+        ap.error('need an image or --synthetic')
+    if len(image) > FLASH_SIZE:
+        ap.error('image larger than %d bytes' % FLASH_SIZE)
+
+    results = []
+    proc = None
+    path = args.port
+    if args.sim:
+        proc, path = s.start_sim(args.sim)
+    try:
+        port = s.Port(path)
+        wait_ready(port)
+        if args.baud != 115200:
+            port.negotiate(args.baud)
+        # no data and no page write, just to see if the command is known
+        probe = port.command([s.CMD_EXT_PROGRAM_FLASH_PACKED, 0, 0, 0x41, 6, 0x40, 0x4C, 0x20, 0xFF, 0xFF])
+        for packed in (False, True):
+            if packed and probe[1] == s.STATUS_CMD_UNKNOWN:
+                print('firmware has no CMD_EXT_PROGRAM_FLASH_PACKED', file=sys.stderr)
+                break
+            port.command(ENTER)
+            port.command(ERASE)
+            seconds, sent, payload = program(port, image, args.page, packed)
+            verified = verify(port, image)
+            verified_crc = verify_crc(port, image)
+            port.command(LEAVE)
+            results.append({
+                'command': 'PROGRAM_FLASH_PACKED' if packed else 'PROGRAM_FLASH_ISP',
+                'image_bytes': len(image),
+                'data_bytes': payload,
+                'uart_bytes': sent,
+                'seconds': seconds,
+                'kbytes_per_s': len(image) / 1024.0 / seconds,
+                'verify_seconds': verified[0],
+                'verify_uart_bytes': verified[1],
+                'verify_crc_seconds': verified_crc[0] if verified_crc else None,
+                'verify_crc_uart_bytes': verified_crc[1] if verified_crc else None,
+            })
+        if args.reprogram:
+            answer = port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_SKIP_UNCHANGED, 1])
+            if answer[1] != s.STATUS_CMD_OK:
+                raise s.ProtocolError('firmware has no PARAM_EXT_SKIP_UNCHANGED')
+            port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_UNCHANGED_PAGES_LOW, 0])
+            port.command(ENTER)
+            try:
+                seconds, sent, payload = program(port, image, args.page, False)
+                verify(port, image)
+            finally:
+                port.command(LEAVE)
+                port.command([s.CMD_SET_PARAMETER, s.PARAM_EXT_SKIP_UNCHANGED, 0])
+            results.append({
+                'command': 'REPROGRAM_UNCHANGED',
+                'image_bytes': len(image),
+                'data_bytes': payload,
+                'uart_bytes': sent,
+                'seconds': seconds,
+                'kbytes_per_s': len(image) / 1024.0 / seconds,
+                'pages': (len(image) + args.page - 1) // args.page,
+                'unchanged_pages': read_param16(port, s.PARAM_EXT_UNCHANGED_PAGES_LOW),
+            })
+    finally:
+        if proc:
+            s.stop_sim(proc)
+
+    if args.json:
+        json.dump({'results': results}, sys.stdout, indent=1)
+        print()
+        return
+    print('%-22s %10s %10s %10s %8s' % ('command', 'data', 'uart', 'seconds', 'kB/s'))
+    for r in results:
+        print('%-22s %10d %10d %10.2f %8.2f' % (r['command'], r['data_bytes'], r['uart_bytes'],
+                                               r['seconds'], r['kbytes_per_s']))
+    for r in results[:1]:
+        print('verify by read back: %.2fs, %d UART bytes' % (r['verify_seconds'], r['verify_uart_bytes']))
+        if r['verify_crc_seconds'] is not None:
+            print('verify by CRC-32:    %.2fs, %d UART bytes' % (r['verify_crc_seconds'], r['verify_crc_uart_bytes']))
+    if len(results) >= 2 and results[1]['command'] == 'PROGRAM_FLASH_PACKED':
+        print('packed: %.1f%% of the UART bytes, %.1f%% of the time' %
+              (100.0 * results[1]['uart_bytes'] / results[0]['uart_bytes'],
+               100.0 * results[1]['seconds'] / results[0]['seconds']))
+    if results and results[-1]['command'] == 'REPROGRAM_UNCHANGED':
+        r = results[-1]
+        print('reprogram: %d of %d pages unchanged, %.1f%% of the time' %
+              (r['unchanged_pages'], r['pages'], 100.0 * r['seconds'] / results[0]['seconds']))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+# vim: set sw=4 ts=4 si et:
+#
+# Dump the performance counters of the programmer (PARAM_EXT_PERF_*,
+# see command_ext.h): frames, errors, SPI traffic, where the time went
+# and the command time histograms. Run it after a job, --reset clears
+# the counters and the command trace for the next one:
+#
+#   avrdude -c stk500v2 -P /dev/ttyACM0 -p m328p -U flash:w:app.hex && \
+#       tools/perfdump.py /dev/ttyACM0 --reset
+#
+# Reading the counters does not change them. --trace adds the last
+# commands the programmer processed (CMD_EXT_TRACE), to see which one
+# failed or was slow after a job went wrong.
+#
+# Author: Clancy Palmer
+# License: GPL
+
+import argparse
+import json
+import sys
+
+import stk500 as s
+from bench import wait_ready
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__)
+    ap.add_argument('port', nargs='?', help='serial port of the programmer')
+    ap.add_argument('--sim', metavar='BINARY', help='start the host build and use its pty')
+    ap.add_argument('--reset', action='store_true', help='clear the counters and the trace after reading them')
+    ap.add_argument('--trace', action='store_true', help='also show the last commands')
+    ap.add_argument('--json', action='store_true', help='machine readable output')
+    args = ap.parse_args()
+    if not args.port and not args.sim:
+        ap.error('need a port or --sim')
+
+    proc = None
+    path = args.port
+    if args.sim:
+        proc, path = s.start_sim(args.sim)
+    try:
+        port = s.Port(path)
+        if proc:
+            wait_ready(port)
+        else:
+            port.drain()
+        perf = s.read_perf(port)
+        if perf is not None and args.reset:
+            s.clear_perf(port)
+        # the trace belongs to the job as well, --reset clears it without --trace
+        trace = s.read_trace(port, args.reset) if args.trace or args.reset else None
+    finally:
+        if proc:
+            s.stop_sim(proc)
+
+    if perf is None:
+        sys.exit('the programmer has no performance counters')
+    if args.trace and trace is None:
+        sys.exit('the programmer has no command trace')
+    if args.json:
+        if args.trace:
+            perf['trace'] = trace
+        json.dump(perf, sys.stdout, indent=1)
+        print()
+        return
+    for line in s.format_perf(perf):
+        print(line)
+    if args.trace:
+        print()
+        for line in s.format_trace(trace):
+            print(line)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+# vim: set sw=4 ts=4 si et:
+#
+# Replay the AVR Studio session captured from a real STK500
+# (Hardware/avrusb500v2/atmel_stk500_v2/CommunicationLogFromRealSTK500.txt)
+# against the programmer or the host build:
+#
+#   tools/replay.py --sim sim/avrusb500v3-sim
+#   tools/replay.py /dev/ttyACM0 [--json] [-v]
+#
+# Every request frame of the log is sent unchanged and the answer is
+# compared with the one the STK500 gave: a different status or length is
+# a mismatch, different data only a note (versions, fuses and flash
+# contents depend on the programmer and target). The response time of
+# each command is compared with the STK500 timestamps, command types
+# that are more than --factor times slower are flagged. The log
+# timestamps have the 15.6ms resolution of the Windows clock, so the
+# STK500 times are summed per command type. A chip erase with pollMethod 0
+# answered before its eraseDelay is a mismatch too, the host would go on
+# with a chip that is still erasing.
+#
+# Author: Clancy Palmer
+# License: GPL
+
+import argparse
+import json
+import os
+import re
+import sys
+import time
+
+import stk500 as s
+from bench import wait_ready
+
+LOG = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'Hardware', 'avrusb500v2',
+                   'atmel_stk500_v2', 'CommunicationLogFromRealSTK500.txt')
+# resolution of the log timestamps in ms
+LOG_RESOLUTION = 15.6
+
+PACKET = re.compile(r'^(Sending|Receiving) packet \S+ (\d+):(\d+):([\d.]+)')
+# long packets continue on lines without the timeout prefix
+DATA = re.compile(r'^(?:\(\s*\d+ms\) )?([<>]) ((?:[0-9A-F]{2} )+)')
+
+
+def parse_log(name):
+    """Return a list of (request frame, expected answer body, STK500 ms)."""
+    pairs = []
+    request = answer = None
+    t_send = t_recv = 0.0
+    with open(name) as f:
+        for line in f:
+            m = PACKET.match(line)
+            if m:
+                t = int(m.group(2)) * 3600 + int(m.group(3)) * 60 + float(m.group(4))
+                if m.group(1) == 'Sending':
+                    if request and answer:
+                        pairs.append((request, answer, t_recv - t_send))
+                    request, answer, t_send = bytearray(), None, t
+                else:
+                    answer, t_recv = bytearray(), t
+                continue
+            m = DATA.match(line)
+            if m and request is not None:
+                data = bytes.fromhex(m.group(2))
+                if m.group(1) == '>' and answer is None:
+                    request += data
+                elif m.group(1) == '<' and answer is not None:
+                    answer += data
+    if request and answer:
+        pairs.append((request, answer, t_recv - t_send))
+    for req, ans, ms in pairs:
+        for frm in (req, ans):
+            if len(frm) < 6 or len(frm) != ((frm[2] << 8) | frm[3]) + 6:
+                raise ValueError('%s: packet %d is truncated' % (name, frm[1]))
+    # strip the framing of the answers: start, seq, size, token ... checksum
+    return [(bytes(req), bytes(ans[5:-1]), 1000.0 * ms) for req, ans, ms in pairs]
+
+
+def compare(expected, answer):
+    if len(answer) < 2 or answer[0] != expected[0] or answer[1] != expected[1]:
+        return 'status'
+    if len(answer) != len(expected):
+        return 'length'
+    if answer != expected:
+        return 'data'
+    return None
+
+
+def min_ms(request):
+    """Time the programmer has to wait before it may answer request."""
+    if request[5] == s.CMD_CHIP_ERASE_ISP and request[7] == 0:
+        return request[6]
+    return 0
+
+
+def replay(port, pairs, verbose):
+    stats = {}
+    for n, (request, expected, stk_ms) in enumerate(pairs):
+        name = s.CMD_NAMES.get(request[5], '0x%02x' % request[5])[4:]
+        t = time.monotonic()
+        port.write(request)
+        seq, answer, ok = port.receive()
+        ms = 1000.0 * (time.monotonic() - t)
+        if not ok or seq != request[1]:
+            raise s.ProtocolError('packet %d: bad answer framing' % (n + 1))
+        diff = compare(expected, answer)
+        if not diff and ms < min_ms(request):
+            diff = 'early'
+        st = stats.setdefault(name, {'command': name, 'count': 0, 'mismatches': 0, 'data_differs': 0,
+                                     'ms': 0.0, 'max_ms': 0.0, 'stk500_ms': 0.0, 'min_ms': 0.0})
+        st['count'] += 1
+        st['ms'] += ms
+        st['max_ms'] = max(st['max_ms'], ms)
+        st['stk500_ms'] += stk_ms
+        st['min_ms'] += min_ms(request)
+        if diff == 'data':
+            st['data_differs'] += 1
+        elif diff:
+            st['mismatches'] += 1
+        if verbose or diff in ('status', 'length', 'early'):
+            print('%3d %-18s %7.1fms (STK500 %5.1fms) %s' % (n + 1, name, ms, stk_ms, diff or ''))
+            if diff:
+                print('    expected %s\n    got      %s' % (expected.hex(' '), bytes(answer).hex(' ')))
+    return list(stats.values())
+
+
+def main():
+    ap = argparse.ArgumentParser(description='replay a real STK500 session')
+    ap.add_argument('port', nargs='?', help='serial port of the programmer')
+    ap.add_argument('--sim', metavar='BINARY', help='start the host build and use its pty')
+    ap.add_argument('--log', default=LOG, help='STK500 communication log')
+    ap.add_argument('--factor', type=float, default=2.0,
+                    help='flag commands slower than FACTOR times the STK500 (default 2)')
+    ap.add_argument('--strict', action='store_true', help='exit with an error on mismatches')
+    ap.add_argument('--json', action='store_true', help='machine readable output')
+    ap.add_argument('-v', action='store_true', help='show every packet')
+    args = ap.parse_args()
+    if not args.port and not args.sim:
+        ap.error('need a port or --sim')
+
+    pairs = parse_log(args.log)
+    proc = None
+    path = args.port
+    if args.sim:
+        proc, path = s.start_sim(args.sim)
+    try:
+        port = s.Port(path)
+        wait_ready(port)
+        results = replay(port, pairs, args.v)
+    finally:
+        if proc:
+            s.stop_sim(proc)
+
+    slow = mismatches = 0
+    for r in results:
+        # the STK500 total is at least half a clock tick per command and
+        # the delays the commands ask for
+        ref = max(r['stk500_ms'], r['count'] * LOG_RESOLUTION / 2, r['min_ms'])
+        r['slow'] = r['ms'] > args.factor * ref
+        r['ms_per_cmd'] = r['ms'] / r['count']
+        r['stk500_ms_per_cmd'] = r['stk500_ms'] / r['count']
+        slow += r['slow']
+        mismatches += r['mismatches']
+
+    if args.json:
+        json.dump({'packets': len(pairs), 'results': results}, sys.stdout, indent=1)
+        print()
+    else:
+        print('%-18s %5s %5s %5s %10s %10s %12s' % ('command', 'count', 'mism', 'data', 'ms/cmd', 'max ms',
+                                                    'STK500 ms/cmd'))
+        for r in results:
+            print('%-18s %5d %5d %5d %10.2f %10.2f %12.2f%s' % (r['command'], r['count'], r['mismatches'],
+                                                               r['data_differs'], r['ms_per_cmd'], r['max_ms'],
+                                                               r['stk500_ms_per_cmd'], '  SLOW' if r['slow'] else ''))
+        print('%d packets, %d mismatches, %d slow command types' % (len(pairs), mismatches, slow))
+    return 1 if args.strict and (mismatches or slow) else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,337 @@
+# vim: set sw=4 ts=4 si et:
+#
+# STK500v2 framing for the avrusb500v3 host tools (AVR068 section 3).
+# Python standard library only, works with the real programmer and with
+# the host build in sim/.
+#
+# Author: Clancy Palmer
+# License: GPL
+
+import os
+import select
+import subprocess
+import termios
+import time
+
+MESSAGE_START = 0x1B
+TOKEN = 0x0E
+ANSWER_CKSUM_ERROR = 0xB0
+
+CMD_SIGN_ON = 0x01
+CMD_SET_PARAMETER = 0x02
+CMD_GET_PARAMETER = 0x03
+CMD_LOAD_ADDRESS = 0x06
+CMD_FIRMWARE_UPGRADE = 0x07
+CMD_ENTER_PROGMODE_ISP = 0x10
+CMD_LEAVE_PROGMODE_ISP = 0x11
+CMD_CHIP_ERASE_ISP = 0x12
+CMD_PROGRAM_FLASH_ISP = 0x13
+CMD_READ_FLASH_ISP = 0x14
+CMD_PROGRAM_EEPROM_ISP = 0x15
+CMD_READ_EEPROM_ISP = 0x16
+CMD_PROGRAM_FUSE_ISP = 0x17
+CMD_READ_FUSE_ISP = 0x18
+CMD_PROGRAM_LOCK_ISP = 0x19
+CMD_READ_LOCK_ISP = 0x1A
+CMD_READ_SIGNATURE_ISP = 0x1B
+CMD_READ_OSCCAL_ISP = 0x1C
+CMD_SPI_MULTI = 0x1D
+CMD_EXT_PROGRAM_FLASH_PACKED = 0x70
+CMD_EXT_CHECKSUM_ISP = 0x71
+CMD_EXT_TRACE = 0x72
+
+STATUS_CMD_OK = 0x00
+STATUS_CMD_FAILED = 0xC0
+STATUS_CMD_UNKNOWN = 0xC9
+
+TRACE_ENTRY = 7
+
+PACKED_HISTORY = 16
+
+CMD_NAMES = {v: k for k, v in globals().items() if k.startswith('CMD_')}
+
+BAUD = {9600: termios.B9600, 19200: termios.B19200, 38400: termios.B38400,
+        57600: termios.B57600, 115200: termios.B115200, 230400: termios.B230400,
+        460800: termios.B460800, 576000: termios.B576000}
+
+# vendor parameters (command_ext.h)
+PARAM_EXT_EARLY_ANSWER = 0xE2
+PARAM_EXT_WAIT_REQUESTED_LOW = 0xEE
+PARAM_EXT_WAIT_BLOCKED_LOW = 0xF0
+PARAM_EXT_DELAY_PROFILE = 0xF2
+PARAM_EXT_RECONNECT_GRACE = 0xF3
+PARAM_EXT_SKIP_UNCHANGED = 0xF7
+PARAM_EXT_UNCHANGED_PAGES_LOW = 0xF8
+PARAM_EXT_RX_TIMEOUTS = 0xFA
+PARAM_EXT_RX_RESYNCS = 0xFB
+PARAM_EXT_SCK_FAST = 0xFF
+
+# PARAM_EXT_EEPROM bits, n << EEPROM_PAGE_SHIFT writes word mode in 2^n byte pages
+PARAM_EXT_EEPROM = 0xFE
+EEPROM_RDY_BSY = 0x01
+EEPROM_SKIP_UNCHANGED = 0x02
+EEPROM_PAGE_SHIFT = 4
+
+# PARAM_EXT_BAUD values, rates the 18.432MHz crystal divides to exactly
+PARAM_EXT_BAUD = 0xF5
+PARAM_EXT_BAUD_DEFAULT = 0xF6
+BAUD_CODES = {115200: 0, 230400: 1, 460800: 2, 576000: 3}
+
+# performance counters (command_ext.h), read through an index
+PARAM_EXT_PERF_SELECT = 0xFC
+PARAM_EXT_PERF_DATA = 0xFD
+PERF_COUNTERS = ['frames', 'cksum_errors', 'uart_overruns', 'spi_bytes', 'spi_time',
+                 'poll_time', 'delay_time', 'uart_wait', 'poll_timeouts', 'sync_retries',
+                 'eeprom_unchanged', 'stack_free', 'delay_overshoot']
+PERF_TIMES = ('spi_time', 'poll_time', 'delay_time', 'uart_wait', 'delay_overshoot')    # in 1/8 ms
+PERF_CLASSES = ['program', 'read', 'session', 'other']
+PERF_BUCKETS = ['<1ms', '<4ms', '<16ms', '<64ms', '>=64ms']
+
+
+class ProtocolError(Exception):
+    pass
+
+
+def frame(seq, body):
+    """Build a complete message: start, seqnum, size, token, body, checksum."""
+    msg = bytes([MESSAGE_START, seq & 0xFF, len(body) >> 8, len(body) & 0xFF, TOKEN]) + bytes(body)
+    ck = 0
+    for b in msg:
+        ck ^= b
+    return msg + bytes([ck])
+
+
+def pack(data):
+    """Pack data for CMD_EXT_PROGRAM_FLASH_PACKED (see command_ext.h).
+    Greedy: the longest copy from the last PACKED_HISTORY bytes, 0xFF
+    before the start, literals where no copy of 3 or more bytes fits."""
+    buf = b'\xff' * PACKED_HISTORY + bytes(data)
+    out = bytearray()
+    lit = bytearray()
+    i = PACKED_HISTORY
+    while i < len(buf):
+        best, dist = 0, 0
+        for d in range(1, PACKED_HISTORY + 1):
+            n = 0
+            while i + n < len(buf) and n < 129 and buf[i + n] == buf[i + n - d]:
+                n += 1
+            if n > best:
+                best, dist = n, d
+        if best >= 3:
+            if lit:
+                out += bytes([len(lit) - 1]) + lit
+                lit = bytearray()
+            out += bytes([0x80 | (best - 2), dist - 1])
+            i += best
+        else:
+            lit.append(buf[i])
+            i += 1
+            if len(lit) == 128:
+                out += bytes([127]) + lit
+                lit = bytearray()
+    if lit:
+        out += bytes([len(lit) - 1]) + lit
+    return bytes(out)
+
+
+def unpack(packed):
+    """Reference decoder, the inverse of pack()."""
+    out = bytearray(b'\xff' * PACKED_HISTORY)
+    i = 0
+    while i < len(packed):
+        c = packed[i]
+        if c & 0x80:
+            d = packed[i + 1] + 1
+            for _ in range((c & 0x7F) + 2):
+                out.append(out[-d])
+            i += 2
+        else:
+            out += packed[i + 1:i + 2 + c]
+            i += 2 + c
+    return bytes(out[PACKED_HISTORY:])
+
+
+class Port:
+    """Raw serial port or pseudo terminal."""
+
+    def __init__(self, path, baud=115200):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        t = termios.tcgetattr(self.fd)
+        t[0] = 0                                    # iflag
+        t[1] = 0                                    # oflag
+        t[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+        t[3] = 0                                    # lflag
+        t[6][termios.VMIN] = 0
+        t[6][termios.VTIME] = 0
+        termios.tcsetattr(self.fd, termios.TCSANOW, t)
+        self.speed(baud)
+        termios.tcflush(self.fd, termios.TCIOFLUSH)
+        self.seq = 0
+        self.buf = b''
+
+    def speed(self, baud):
+        """Set the baud rate of the host side only."""
+        t = termios.tcgetattr(self.fd)
+        t[4] = t[5] = BAUD.get(baud, termios.B115200)
+        termios.tcsetattr(self.fd, termios.TCSADRAIN, t)
+        self.baud = baud
+
+    def negotiate(self, baud):
+        """Switch programmer and host to baud. The programmer changes after
+        its answer and falls back to 115200 if it does not get a valid
+        message within 1s, so on failure the host goes back too."""
+        answer = self.command([CMD_SET_PARAMETER, PARAM_EXT_BAUD, BAUD_CODES[baud]])
+        if len(answer) < 2 or answer[1] != STATUS_CMD_OK:
+            raise ProtocolError('programmer can not switch to %d baud' % baud)
+        self.speed(baud)
+        try:
+            self.command([CMD_SIGN_ON], timeout=0.5)
+        except ProtocolError:
+            self.speed(115200)
+            time.sleep(1.2)
+            self.drain(0)
+            raise ProtocolError('no answer at %d baud, back to 115200' % baud)
+
+    def close(self):
+        os.close(self.fd)
+
+    def write(self, data):
+        while data:
+            n = os.write(self.fd, data)
+            data = data[n:]
+
+    def read(self, n, timeout):
+        end = time.monotonic() + timeout
+        while len(self.buf) < n:
+            left = end - time.monotonic()
+            if left <= 0:
+                raise ProtocolError('timeout')
+            r, _, _ = select.select([self.fd], [], [], left)
+            if r:
+                self.buf += os.read(self.fd, 4096)
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+    def drain(self, wait=0.05):
+        """Discard anything pending, e.g. after an aborted frame."""
+        time.sleep(wait)
+        while select.select([self.fd], [], [], 0)[0]:
+            if not os.read(self.fd, 4096):
+                break
+        self.buf = b''
+
+    def send(self, body, seq=None):
+        if seq is None:
+            self.seq = (self.seq + 1) & 0xFF
+            seq = self.seq
+        self.write(frame(seq, body))
+        return seq
+
+    def receive(self, timeout=5.0):
+        """Return (seq, body, checksum_ok) of the next answer."""
+        while self.read(1, timeout)[0] != MESSAGE_START:
+            pass
+        hdr = self.read(4, timeout)
+        if hdr[3] != TOKEN:
+            raise ProtocolError('bad token 0x%02x' % hdr[3])
+        size = (hdr[1] << 8) | hdr[2]
+        body = self.read(size, timeout)
+        ck = self.read(1, timeout)[0]
+        calc = MESSAGE_START
+        for b in hdr + body:
+            calc ^= b
+        return hdr[0], body, calc == ck
+
+    def command(self, body, timeout=5.0):
+        """Send one command and return the answer body."""
+        seq = self.send(body)
+        rseq, answer, ok = self.receive(timeout)
+        if not ok:
+            raise ProtocolError('answer checksum error')
+        if rseq != seq:
+            raise ProtocolError('seqnum %d, expected %d' % (rseq, seq))
+        if answer and answer[0] == ANSWER_CKSUM_ERROR:
+            raise ProtocolError('programmer reported checksum error')
+        return answer
+
+
+def read_perf(port):
+    """Performance counters of the programmer as a dict, times in ms,
+    'histogram' maps the command classes to their bucket counts. None if
+    the firmware has no counters."""
+    answer = port.command([CMD_GET_PARAMETER, PARAM_EXT_PERF_SELECT])
+    if len(answer) < 3 or answer[1] != STATUS_CMD_OK:
+        return None
+    count = answer[2]
+    port.command([CMD_SET_PARAMETER, PARAM_EXT_PERF_SELECT, 0])
+    values = []
+    for _ in range(count):
+        v = 0
+        for i in range(4):
+            answer = port.command([CMD_GET_PARAMETER, PARAM_EXT_PERF_DATA])
+            v |= answer[2] << (8 * i)
+        values.append(v)
+    out = {}
+    for name, v in zip(PERF_COUNTERS, values):
+        out[name] = v / 8.0 if name in PERF_TIMES else v
+    hist = values[len(PERF_COUNTERS):]
+    n = len(PERF_BUCKETS)
+    out['histogram'] = {c: hist[i * n:(i + 1) * n] for i, c in enumerate(PERF_CLASSES)}
+    return out
+
+
+def clear_perf(port):
+    port.command([CMD_SET_PARAMETER, PARAM_EXT_PERF_DATA, 0])
+
+
+def format_perf(perf):
+    """Text lines for read_perf() results."""
+    lines = ['%-14s %10s' % ('counter', 'value')]
+    for name in PERF_COUNTERS:
+        if name in PERF_TIMES:
+            lines.append('%-14s %10.1f ms' % (name, perf[name]))
+        else:
+            lines.append('%-14s %10d' % (name, perf[name]))
+    lines.append('%-14s' % 'command time' + ''.join('%8s' % b for b in PERF_BUCKETS))
+    for c in PERF_CLASSES:
+        lines.append('%-14s' % c + ''.join('%8d' % v for v in perf['histogram'][c]))
+    return lines
+
+
+def read_trace(port, clear=False):
+    """The last commands the programmer processed, oldest first, as dicts
+    (time in ms). None if the firmware has no trace."""
+    answer = port.command([CMD_EXT_TRACE, 1 if clear else 0])
+    if len(answer) < 2 or answer[1] != STATUS_CMD_OK:
+        return None
+    out = []
+    for i in range(2, len(answer) - TRACE_ENTRY + 1, TRACE_ENTRY):
+        e = answer[i:i + TRACE_ENTRY]
+        out.append({'command': e[0], 'seqnum': e[1], 'status': e[2],
+                    'address': (e[3] << 8) | e[4], 'time': ((e[5] << 8) | e[6]) / 8.0})
+    return out
+
+
+def format_trace(trace):
+    """Text lines for read_trace() results."""
+    lines = ['%-28s %4s %7s %8s %9s' % ('command', 'seq', 'status', 'address', 'time ms')]
+    for e in trace:
+        name = CMD_NAMES.get(e['command'], 'ANSWER_CKSUM_ERROR' if e['command'] == ANSWER_CKSUM_ERROR
+                             else '0x%02x' % e['command'])
+        lines.append('%-28s %4d    0x%02x   0x%04x %9.3f' %
+                     (name, e['seqnum'], e['status'], e['address'], e['time']))
+    return lines
+
+
+def start_sim(binary, env=None):
+    """Start the host build, return (process, pty path)."""
+    proc = subprocess.Popen([binary], stdout=subprocess.PIPE, env=env)
+    path = proc.stdout.readline().decode().strip()
+    if not path:
+        raise ProtocolError('simulator did not start')
+    return proc, path
+
+
+def stop_sim(proc):
+    proc.terminate()
+    proc.wait()
@@ -1,6 +1,6 @@
 /* vim: set sw=2 ts=2 si et: */
 /*********************************************
-* UART interface without interrupts
+* UART interface, interrupt driven receive and transmit
 *
 * Modified by: Clancy Palmer
 * Original Author: Guido Socher
@@ -16,9 +16,31 @@
 #include "uart.h"
 #include "analog.h"
 #include "led.h"
+#include "hal.h"
 
 static unsigned char prg_state = 0;  // 0 = Idle, 1 = Programming
 
+// Receive ring buffer, filled by the RX complete interrupt. rx_head is
+// only written by the ISR and rx_tail only by uart_getchar() so no locking
+// is needed for the single byte indices.
+static volatile unsigned char rx_buf[UART_RX_BUFSIZE];
+static volatile unsigned char rx_head = 0;
+static volatile unsigned char rx_tail = 0;
+// Transmit ring buffer for single characters and a block that is sent
+// straight from the caller's memory after the ring buffer drained. The
+// UDRE interrupt keeps the transmitter busy back to back so the MCP2200
+// can fill whole USB packets.
+static volatile unsigned char tx_buf[UART_TX_BUFSIZE];
+static volatile unsigned char tx_head = 0;
+static volatile unsigned char tx_tail = 0;
+static const unsigned char * volatile tx_blk;
+static volatile unsigned int tx_blk_len = 0;
+static volatile unsigned char tx_blk_busy = 0;
+static unsigned long tx_wait_time = 0;  // in 1/TIMER_TICKS_MS ms
+// Receive error counters, saturate at 255
+static volatile unsigned char rx_overruns = 0;
+static volatile unsigned char rx_framing_errors = 0;
+
 unsigned char prg_state_get(void)
 {
   return prg_state;
@@ -29,6 +51,38 @@ void prg_state_set(unsigned char p)
   prg_state = p;
 }
 
+// UBRR for UART_BAUD_*, bit 7 selects double speed (U2X0)
+static const unsigned char baud_ubrr[] PROGMEM = {
+  9,            // 18.432MHz / 16 / 10 = 115200
+  4,            // 18.432MHz / 16 / 5 = 230400
+  0x80 | 4,     // 18.432MHz / 8 / 5 = 460800
+  1             // 18.432MHz / 16 / 2 = 576000
+};
+static unsigned char baud_rate = UART_BAUD_115200;
+
+/* switch the baud rate, whatever is still being sent goes out at the old rate */
+void uart_set_baud(unsigned char rate)
+{
+  unsigned char ubrr = pgm_read_byte(&baud_ubrr[rate]);
+
+  while (tx_blk_busy || tx_head != tx_tail || (UCSR0B & (1 << UDRIE0))) HAL_IDLE();
+  // the last byte is in the shift register now
+  timer_wait(timer_deadline(1));
+  baud_rate = rate;
+  UBRR0H = 0;
+  UBRR0L = ubrr & 0x7F;
+  if (ubrr & 0x80) {
+    UCSR0A |= (1 << U2X0);
+  } else {
+    UCSR0A &= ~(1 << U2X0);
+  }
+}
+
+unsigned char uart_get_baud(void)
+{
+  return baud_rate;
+}
+
 void uart_init(void)
 {
   // baud=9=115.2K with an external 18.4320MHz crystal
@@ -36,18 +90,123 @@ void uart_init(void)
 
   UBRR0H = (unsigned char) (baud >> 8);
   UBRR0L = (unsigned char) (baud & 0xFF);
-  /* enable tx/rx and no interrupt on tx/rx */
-  UCSR0B =  (1 << RXEN0) | (1 << TXEN0);
+  /* enable tx/rx and interrupt on rx complete */
+  UCSR0B =  (1 << RXCIE0) | (1 << RXEN0) | (1 << TXEN0);
   /* format: asynchronous, 8N1 */
   UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
 }
 
+/* receive complete, pass the byte to the message parser or the ring buffer */
+ISR(USART_RX_vect)
+{
+  // status must be read before UDR0
+  unsigned char status = UCSR0A;
+  unsigned char c = UDR0;
+  unsigned char next = (rx_head + 1) & (UART_RX_BUFSIZE - 1);
+
+  if ((status & (1 << DOR0)) && rx_overruns != 0xFF) {
+    rx_overruns++;
+  }
+  if (status & (1 << FE0)) {
+    // byte is garbage, drop it
+    if (rx_framing_errors != 0xFF) {
+      rx_framing_errors++;
+    }
+    return;
+  }
+  if (uart_rx_msg(c)) {
+    return;
+  }
+  if (next == rx_tail) {
+    // ring buffer full, the byte is lost just like a hardware overrun
+    if (rx_overruns != 0xFF) {
+      rx_overruns++;
+    }
+    return;
+  }
+  rx_buf[rx_head] = c;
+  rx_head = next;
+}
+
+/* data register empty, send the next byte from the ring buffer or the block */
+ISR(USART_UDRE_vect)
+{
+  if (tx_head != tx_tail) {
+    UDR0 = tx_buf[tx_tail];
+    tx_tail = (tx_tail + 1) & (UART_TX_BUFSIZE - 1);
+  } else if (tx_blk_busy) {
+    UDR0 = *tx_blk++;
+    if (--tx_blk_len == 0) {
+      tx_blk_busy = 0;
+    }
+  } else {
+    // nothing left to send
+    UCSR0B &= ~(1 << UDRIE0);
+  }
+}
+
+/* wait for the end of the block passed to uart_sendbuf() */
+static void tx_blk_wait(void)
+{
+  uint16_t t;
+
+  if (!tx_blk_busy) {
+    return;
+  }
+  t = timer_now();
+  while (tx_blk_busy) HAL_IDLE();
+  tx_wait_time += (uint16_t)(timer_now() - t);
+}
+
 /* send one character to the rs232 */
 void uart_sendchar(char c)
 {
-  /* wait for empty transmit buffer */
-  while (!(UCSR0A & (1 << UDRE0)));
-  UDR0 = c;
+  unsigned char next = (tx_head + 1) & (UART_TX_BUFSIZE - 1);
+  // keep the byte order, a pending block goes out first
+  tx_blk_wait();
+  /* wait for space in the transmit buffer */
+  while (next == tx_tail) HAL_IDLE();
+  tx_buf[tx_head] = c;
+  tx_head = next;
+  UCSR0B |= (1 << UDRIE0);
+}
+
+/* send len bytes from buf in the background. buf must not be
+ * changed until uart_tx_busy() returns 0 */
+void uart_sendbuf(const unsigned char *buf, unsigned int len)
+{
+  if (len == 0) {
+    return;
+  }
+  tx_blk_wait();
+  tx_blk = buf;
+  tx_blk_len = len;
+  tx_blk_busy = 1;
+  UCSR0B |= (1 << UDRIE0);
+}
+
+/* returns 1 while a block passed to uart_sendbuf() is being sent */
+unsigned char uart_tx_busy(void)
+{
+  return tx_blk_busy;
+}
+
+/* wait until the block passed to uart_sendbuf() has been sent */
+void uart_tx_wait(void)
+{
+  tx_blk_wait();
+}
+
+/* time spent in uart_tx_wait() and waiting for a block to go out before
+ * sending, in 1/TIMER_TICKS_MS ms */
+unsigned long uart_tx_wait_time(void)
+{
+  return tx_wait_time;
+}
+
+void uart_tx_wait_clear(void)
+{
+  tx_wait_time = 0;
 }
 /* send string to the rs232 */
 void uart_sendstr(char *s)
@@ -67,41 +226,71 @@ void uart_sendstr_p(const char *progmem_s)
   }
 }
 
-/* get a byte from rs232. This function does a blocking read */
-unsigned char uart_getchar(unsigned char kickwd)
+/* number of received bytes waiting in the ring buffer */
+unsigned char uart_rx_available(void)
 {
-  unsigned char l = 1;
-  while (!(UCSR0A & (1 << RXC0))) {
-    // we can not aford a watchdog timeout because this is a blocking function
-    if (kickwd) {
-      wdt_reset();
-    }
+  return (rx_head - rx_tail) & (UART_RX_BUFSIZE - 1);
+}
 
-    if (prg_state_get()) {
-      // Programming is ongoing
-      continue;
-    }
+/* one round of a wait loop: kick the watchdog and show the
+ * target voltage state on the LED while not programming */
+void uart_idle(unsigned char kickwd)
+{
+  static unsigned char l = 1;
+
+  HAL_IDLE();
+  // we can not aford a watchdog timeout because this is a blocking function
+  if (kickwd) {
+    wdt_reset();
+  }
 
-    if (l == 0) {
-      // Once every 256th loop, l will wrap at 8 bit
-      if (vtarget_valid()) {
-        LED_ON;
-      } else {
-        LED_OFF;
-      }
+  if (prg_state_get()) {
+    // Programming is ongoing
+    return;
+  }
+
+  if (l == 0) {
+    // Once every 256th loop, l will wrap at 8 bit
+    if (vtarget_valid()) {
+      LED_ON;
+    } else {
+      LED_OFF;
     }
+  }
+
+  l++;
+}
 
-    l++;
+/* get a byte from rs232. This function does a blocking read */
+unsigned char uart_getchar(unsigned char kickwd)
+{
+  unsigned char c;
+  while (rx_head == rx_tail) {
+    uart_idle(kickwd);
   }
-  return (UDR0);
+  c = rx_buf[rx_tail];
+  rx_tail = (rx_tail + 1) & (UART_RX_BUFSIZE - 1);
+  return (c);
 }
 /* read and discard any data in the receive buffer */
 void uart_flushRXbuf(void)
 {
-  // __attribute__ to avoid compiler warning
-  unsigned char tmp __attribute__((unused));
-  while (UCSR0A & (1 << RXC0)) {
-    tmp = UDR0;
-  }
+  rx_tail = rx_head;
+}
+
+unsigned char uart_rx_overruns(void)
+{
+  return rx_overruns;
+}
+
+unsigned char uart_rx_framing_errors(void)
+{
+  return rx_framing_errors;
+}
+
+void uart_rx_clear_errors(void)
+{
+  rx_overruns = 0;
+  rx_framing_errors = 0;
 }
 
@@ -1,6 +1,6 @@
 /* vim: set sw=2 ts=2 si et: */
 /*********************************************
-* UART interface without interrupts
+* UART interface, interrupt driven receive and transmit
 *
 * Modified by: Clancy Palmer
 * Original Author: Guido Socher
@@ -12,13 +12,45 @@
 #define UART_H
 #include <avr/pgmspace.h>
 
+// Size of the receive ring buffer, must be a power of 2 and <= 256.
+// STK500v2 messages are parsed by the RX interrupt (uart_rx_msg()), the
+// ring buffer only holds the other bytes, e.g. terminal mode input, and
+// the few that come in while main() takes over the previous message.
+#define UART_RX_BUFSIZE 16
+// Size of the transmit ring buffer, must be a power of 2 and <= 256.
+// Answers are sent from the message buffer (uart_sendbuf()), the ring
+// buffer only holds single characters, e.g. terminal mode output.
+#define UART_TX_BUFSIZE 8
+
+// Rates of uart_set_baud(), exact with the 18.432MHz crystal
+#define UART_BAUD_115200 0
+#define UART_BAUD_230400 1
+#define UART_BAUD_460800 2
+#define UART_BAUD_576000 3
+
 extern void uart_init(void);
+extern void uart_set_baud(unsigned char rate);
+extern unsigned char uart_get_baud(void);
 extern void uart_sendchar(char c);
+extern void uart_sendbuf(const unsigned char *buf, unsigned int len);
+extern unsigned char uart_tx_busy(void);
+extern void uart_tx_wait(void);
+extern unsigned long uart_tx_wait_time(void);
+extern void uart_tx_wait_clear(void);
 extern void uart_sendstr(char *s);
 extern void uart_sendstr_p(const char *progmem_s);
 extern unsigned char uart_getchar(unsigned char kickwd);
+extern void uart_idle(unsigned char kickwd);
 extern void uart_flushRXbuf(void);
+extern unsigned char uart_rx_available(void);
+extern unsigned char uart_rx_overruns(void);       // bytes lost to overrun (USART or ring buffer)
+extern unsigned char uart_rx_framing_errors(void); // bytes dropped because of framing errors
+extern void uart_rx_clear_errors(void);
 extern unsigned char prg_state_get(void);
 extern void prg_state_set(unsigned char p);
 
+// Provided by the application, called from the RX interrupt for every
+// received byte. Returns 0 if the byte should go to the ring buffer.
+extern unsigned char uart_rx_msg(unsigned char c);
+
 #endif /* UART_H */